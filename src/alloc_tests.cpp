@@ -0,0 +1,261 @@
+// -----------------------------------------------------------------------------
+// Allocation regression tests. Global operator new is replaced with a counting
+// version and each scenario asserts an upper bound on the number of heap
+// allocations it makes. If a change pushes a scenario over budget, either fix
+// the regression or raise the budget deliberately.
+// -----------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <string>
+#include "args.h"
+
+using namespace std;
+using namespace args;
+
+// -----------------------------------------------------------------------------
+// Counting allocator.
+// -----------------------------------------------------------------------------
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    void* pointer = malloc(size > 0 ? size : 1);
+    if (pointer == nullptr) {
+        throw bad_alloc();
+    }
+    return pointer;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    free(pointer);
+}
+
+// Fails the test run if [count] exceeds [budget].
+static void check(char const* scenario, size_t count, size_t budget) {
+    if (count > budget) {
+        printf("\n\nFAIL: %s made %zu allocations (budget: %zu)\n", scenario, count, budget);
+        exit(1);
+    }
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 1. Flags.
+// -----------------------------------------------------------------------------
+
+void test_alloc_flag_multi() {
+    ArgParser parser;
+    parser.flag("foo f");
+    vector<string> input({"-fff", "--foo", "-f"});
+    size_t before = allocations;
+    parser.parse(input);
+    check("flag multi", allocations - before, 0);
+}
+
+// -----------------------------------------------------------------------------
+// 2. Options.
+// -----------------------------------------------------------------------------
+
+void test_alloc_option_equals() {
+    ArgParser parser;
+    parser.option("opt o", "default");
+    vector<string> input({"--opt=value"});
+    size_t before = allocations;
+    parser.parse(input);
+    check("option equals", allocations - before, 0);
+}
+
+void test_alloc_option_long_value() {
+    ArgParser parser;
+    parser.option("opt o", "default");
+    vector<string> input({"--opt", "a value that does not fit in the small-string buffer"});
+    size_t before = allocations;
+    parser.parse(input);
+    check("option long value", allocations - before, 1);
+}
+
+void test_alloc_option_many_long_values() {
+    ArgParser parser;
+    parser.option("opt o", "default");
+    vector<string> input;
+    for (int i = 0; i < 100; i++) {
+        input.push_back("--opt");
+        input.push_back("a value that does not fit in the small-string buffer");
+    }
+    size_t before = allocations;
+    parser.parse(input);
+    check("option many long values", allocations - before, 16);
+}
+
+// -----------------------------------------------------------------------------
+// 3. Positional arguments.
+// -----------------------------------------------------------------------------
+
+void test_alloc_positional_10k() {
+    ArgParser parser;
+    vector<string> input(10000, "abc");
+    size_t before = allocations;
+    parser.parse(input);
+    check("10k positionals", allocations - before, 15);
+}
+
+// -----------------------------------------------------------------------------
+// 4. Accessors.
+// -----------------------------------------------------------------------------
+
+void test_alloc_accessors() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.parse(vector<string>({"-f", "--bar", "baz", "--bar", "bam"}));
+
+    size_t before = allocations;
+    parser.found("foo");
+    parser.count("foo");
+    parser.found("bar");
+    parser.count("bar");
+    check("found/count", allocations - before, 0);
+
+    before = allocations;
+    parser.value("bar");
+    check("value", allocations - before, 0);
+
+    before = allocations;
+    parser.values("bar");
+    check("values", allocations - before, 1);
+
+    before = allocations;
+    parser.canonicalHash();
+    check("canonicalHash", allocations - before, 0);
+
+    before = allocations;
+    parser.takeArgs();
+    check("takeArgs", allocations - before, 0);
+
+    before = allocations;
+    parser.takeValues("bar");
+    check("takeValues", allocations - before, 1);
+}
+
+// -----------------------------------------------------------------------------
+// 5. Commands.
+// -----------------------------------------------------------------------------
+
+void test_alloc_command() {
+    ArgParser parser;
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("foo");
+    cmd_parser.option("bar", "default");
+    vector<string> input({"boo", "abc", "--foo", "--bar", "baz"});
+    size_t before = allocations;
+    parser.parse(input);
+    check("command", allocations - before, 1);
+}
+
+// -----------------------------------------------------------------------------
+// 6. Reset and reuse.
+// -----------------------------------------------------------------------------
+
+void test_alloc_reuse() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.option("env e", "default");
+    parser.env("env", "ARGS_ALLOC_TEST");
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("foo f");
+    cmd_parser.option("bar b", "default");
+    cmd_parser.env("bar", "ARGS_ALLOC_TEST");
+    setenv("ARGS_ALLOC_TEST", "from env", 1);
+    vector<string> input({"-ff", "--bar", "baz", "abc", "--bar=bam", "def",
+        "--bar", "a value that does not fit in the small-string buffer"});
+    vector<string> cmd_input({"boo", "-f", "--bar", "baz", "abc"});
+
+    parser.parse(input);
+    parser.reset();
+    parser.parse(cmd_input);
+    parser.reset();
+
+    size_t before = allocations;
+    parser.parse(input);
+    parser.reset();
+    parser.parse(cmd_input);
+    parser.reset();
+    check("reset and reparse", allocations - before, 0);
+}
+
+// -----------------------------------------------------------------------------
+// 7. Map options.
+// -----------------------------------------------------------------------------
+
+void test_alloc_map_reuse() {
+    ArgParser parser;
+    parser.mapOption("define D");
+    vector<string> input;
+    for (int i = 0; i < 100; i++) {
+        input.push_back("-D");
+        input.push_back("key-" + to_string(i) + "=value");
+    }
+    parser.parse(input);
+    parser.reset();
+
+    size_t before = allocations;
+    parser.parse(input);
+    parser.lookup("define", "key-50");
+    parser.hasKey("define", "key-99");
+    check("map reparse and lookup", allocations - before, 0);
+}
+
+// -----------------------------------------------------------------------------
+// Test runner.
+// -----------------------------------------------------------------------------
+
+void line() {
+    for (int i = 0; i < 80; i++) {
+        printf("-");
+    }
+    printf("\n");
+}
+
+int main() {
+    setbuf(stdout, NULL);
+    line();
+
+    printf("Allocs: 1 ");
+    test_alloc_flag_multi();
+
+    printf(" 2 ");
+    test_alloc_option_equals();
+    test_alloc_option_long_value();
+    test_alloc_option_many_long_values();
+
+    printf(" 3 ");
+    test_alloc_positional_10k();
+
+    printf(" 4 ");
+    test_alloc_accessors();
+
+    printf(" 5 ");
+    test_alloc_command();
+
+    printf(" 6 ");
+    test_alloc_reuse();
+
+    printf(" 7 ");
+    test_alloc_map_reuse();
+
+    printf(" [ok]\n");
+    line();
+}
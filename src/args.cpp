@@ -6,196 +6,2866 @@
 
 #include <algorithm>
 #include <cctype>
-#include <iostream>
-#include <sstream>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <list>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <stdlib.h>
+    #define write _write
+    #define environ _environ
+#else
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    extern char** environ;
+#endif
+
+#ifdef __linux__
+    #include <sys/inotify.h>
+#endif
 
 using namespace std;
 using namespace args;
 
 
+// -----------------------------------------------------------------------------
+// Output.
+// -----------------------------------------------------------------------------
+
+
+// A small buffered sink for help text, error messages, and print() output. We
+// write directly to the file descriptor rather than using <iostream> so that
+// linking the library adds no static initializers to the application.
+namespace {
+class Sink {
+    public:
+        explicit Sink(int fd) : fd(fd), length(0) {}
+        ~Sink() { flush(); }
+
+        Sink& operator<<(string const& str);
+        Sink& operator<<(char const* str);
+        Sink& operator<<(size_t n);
+        void flush();
+
+    private:
+        int fd;
+        size_t length;
+        char buffer[1024];
+
+        void append(char const* data, size_t size);
+        void writeAll(char const* data, size_t size);
+};
+}
+
+
+Sink& Sink::operator<<(string const& str) {
+    append(str.data(), str.size());
+    return *this;
+}
+
+
+Sink& Sink::operator<<(char const* str) {
+    append(str, strlen(str));
+    return *this;
+}
+
+
+Sink& Sink::operator<<(size_t n) {
+    char digits[24];
+    size_t i = sizeof(digits);
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    append(digits + i, sizeof(digits) - i);
+    return *this;
+}
+
+
+void Sink::append(char const* data, size_t size) {
+    if (length + size > sizeof(buffer)) {
+        flush();
+        if (size > sizeof(buffer)) {
+            writeAll(data, size);
+            return;
+        }
+    }
+    memcpy(buffer + length, data, size);
+    length += size;
+}
+
+
+// Anything the application has written to the same stream via stdio (or via
+// std::cout, which is synced with stdio) is flushed first so that output
+// appears in the order it was written.
+void Sink::flush() {
+    if (length == 0) {
+        return;
+    }
+    fflush(fd == 2 ? stderr : stdout);
+    writeAll(buffer, length);
+    length = 0;
+}
+
+
+void Sink::writeAll(char const* data, size_t size) {
+    while (size > 0) {
+        auto written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+
+// Print an error message to stderr.
+static void printError(string const& message) {
+    Sink err(2);
+    err << "Error: " << message << "\n";
+}
+
+
+// Print an error message to stderr and exit.
+static void exitError(string const& message) {
+    printError(message);
+    exit(1);
+}
+
+
+// Split a space-separated list of aliases.
+static vector<string> splitAliases(string const& name) {
+    vector<string> aliases;
+    size_t i = 0;
+    while (i < name.size()) {
+        while (i < name.size() && isspace(static_cast<unsigned char>(name[i]))) {
+            i++;
+        }
+        size_t start = i;
+        while (i < name.size() && !isspace(static_cast<unsigned char>(name[i]))) {
+            i++;
+        }
+        if (i > start) {
+            aliases.push_back(name.substr(start, i - start));
+        }
+    }
+    return aliases;
+}
+
+
 // -----------------------------------------------------------------------------
 // Flags and Options.
 // -----------------------------------------------------------------------------
 
 
-struct args::Flag {
-    int count = 0;
+// A vector which stores its first N elements inline. Almost all options are
+// found zero or one times, so this saves a heap allocation per option value in
+// the common case. Clearing keeps the inline elements (and their capacity).
+template<typename T, size_t N>
+class SmallVector {
+    public:
+        SmallVector() : length(0) {}
+
+        size_t size() const {
+            return length;
+        }
+
+        T& operator[](size_t index) {
+            return index < N ? items[index] : overflow[index - N];
+        }
+
+        T const& operator[](size_t index) const {
+            return index < N ? items[index] : overflow[index - N];
+        }
+
+        T const& back() const {
+            return (*this)[length - 1];
+        }
+
+        void push_back(T const& item) {
+            if (length < N) {
+                items[length] = item;
+            } else {
+                overflow.push_back(item);
+            }
+            length++;
+        }
+
+        void clear() {
+            length = 0;
+            overflow.clear();
+        }
+
+    private:
+        T items[N];
+        vector<T> overflow;
+        size_t length;
+};
+
+
+// A parsed value, stored as a slice of the parser's arena.
+struct args::Span {
+    size_t offset;
+    size_t length;
 };
 
 
+// Flags are stored as a dense array of counts in the parser, indexed by the
+// flag's id, so there is no per-flag struct.
 struct args::Option {
-    vector<string> values;
+    SmallVector<Span, 1> values;
     string fallback;
+    string env;
+    bool has_env;
+    string config;
+    bool has_config;
+    atomic<string const*> live;
+    string reloaded;
+    bool has_reloaded;
+    uint64_t identity;
+    uint64_t chain;
+    ChoiceSet* choices;
+    int choice;
+    MapIndex* map;
+    bool taken;
+    Option() : has_env(false), has_config(false), live(nullptr), has_reloaded(false),
+        identity(0), chain(0), choices(nullptr), choice(-1), map(nullptr), taken(false) {}
+    ~Option();
+
+    // The config file's value applies until takeValues() clears the option.
+    bool configured() const {
+        return has_config && !taken;
+    }
+};
+
+
+// -----------------------------------------------------------------------------
+// Live values.
+// -----------------------------------------------------------------------------
+
+
+// An RCU-style domain for publishing live option values. Readers register in
+// one of two counters, selected by the current epoch, for the duration of a
+// read; this is a fixed number of atomic operations, so reads are wait-free.
+// A writer swaps in the new value, then flips the epoch and waits for the
+// counter it flipped away from to drain, twice. After that no reader can still
+// hold the old value and it can be deleted.
+//
+// The counters are striped across reader slots, each on its own cache lines,
+// and threads are dealt slots round-robin. Concurrent readers therefore don't
+// contend on a shared counter; the writer sums over every slot instead.
+struct args::LiveDomain {
+    static const size_t slot_count = 64;
+
+    // Padded so no two slots' counters share a cache line, whatever the
+    // allocator's alignment.
+    struct ReaderSlot {
+        atomic<size_t> readers[2];
+        char padding[128 - 2 * sizeof(atomic<size_t>)];
+    };
+
+    atomic<unsigned> epoch;
+    ReaderSlot slots[slot_count];
+    mutex writer;
+    mutex reloader;
+
+    LiveDomain() : epoch(0) {
+        for (ReaderSlot& slot: slots) {
+            slot.readers[0] = 0;
+            slot.readers[1] = 0;
+        }
+    }
+
+    static size_t threadSlot() {
+        static atomic<size_t> next(0);
+        static thread_local size_t slot = next.fetch_add(1) % slot_count;
+        return slot;
+    }
+
+    unsigned enter() {
+        unsigned current = epoch.load();
+        slots[threadSlot()].readers[current].fetch_add(1);
+        return current;
+    }
+
+    void leave(unsigned current) {
+        slots[threadSlot()].readers[current].fetch_sub(1);
+    }
+
+    // Each reader enters and leaves through the same slot, so a slot seen at
+    // zero after the flip can only be re-entered by readers which will see the
+    // newly published value.
+    void synchronize() {
+        for (int i = 0; i < 2; i++) {
+            unsigned current = epoch.load();
+            epoch.store(current ^ 1);
+            for (ReaderSlot& slot: slots) {
+                while (slot.readers[current].load() != 0) {
+                    this_thread::yield();
+                }
+            }
+        }
+    }
+};
+
+
+// -----------------------------------------------------------------------------
+// ArgStream.
+// -----------------------------------------------------------------------------
+
+
+// A cursor over the argument list. The stream reads the caller's strings in
+// place rather than copying them.
+struct args::ArgStream {
+    vector<string> const& args;
+    size_t index;
+    ArgStream(vector<string> const& args) : args(args), index(0) {}
+    string const& next();
+    bool hasNext();
+};
+
+
+string const& ArgStream::next() {
+    return args[index++];
+}
+
+
+bool ArgStream::hasNext() {
+    return index < args.size();
+}
+
+
+// -----------------------------------------------------------------------------
+// Canonical hashing.
+// -----------------------------------------------------------------------------
+
+
+// The 64-bit finalizer from MurmurHash3.
+static uint64_t mixHash(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+
+// A fast non-cryptographic hash which consumes eight bytes at a time. Results
+// are stable for a given platform but depend on its byte order.
+static uint64_t hashBytes(char const* data, size_t length, uint64_t seed = 0) {
+    uint64_t hash = seed ^ (length * 0x9e3779b97f4a7c15ULL);
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        hash = (hash ^ mixHash(word)) * 0x9fb21c651e98df25ULL;
+        data += 8;
+        length -= 8;
+    }
+    uint64_t word = 0;
+    memcpy(&word, data, length);
+    hash = (hash ^ mixHash(word)) * 0x9fb21c651e98df25ULL;
+    return mixHash(hash);
+}
+
+
+// Combine two hashes. Not commutative, so chaining it preserves order.
+static uint64_t combineHash(uint64_t a, uint64_t b) {
+    return mixHash(a ^ (b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2)));
+}
+
+
+// Identities are seeded by kind so a flag and an option with the same name
+// hash differently.
+static uint64_t identityHash(vector<string> const& aliases, uint64_t seed) {
+    string const& name = aliases.empty() ? string() : aliases[0];
+    return hashBytes(name.data(), name.size(), seed);
+}
+
+
+// Flags and options are found in any order, so each occurrence adds a term to
+// a wrapping sum, which is order-insensitive. The n-th occurrence of a flag
+// adds a term for (flag, n), so '-fv' and '-f -v' give the same sum. An
+// option's values either each add a term or, if their order is significant,
+// are chained into a single term which is replaced as each value is found.
+uint64_t ArgParser::canonicalHash() const {
+    uint64_t hash = combineHash(hash_sum, args_hash);
+    if (commandFound()) {
+        ArgParser const& cmd_parser = commandParser();
+        hash = combineHash(hash, combineHash(cmd_parser.identity, cmd_parser.canonicalHash()));
+    }
+    return hash;
+}
+
+
+// Set the order sensitivity of canonicalHash() for this parser and its
+// commands. Call before parsing.
+void ArgParser::setHashOrder(bool values_ordered, bool args_ordered) {
+    hash_values_ordered = values_ordered;
+    hash_args_ordered = args_ordered;
+    for (auto& element: commands) {
+        element.second->setHashOrder(values_ordered, args_ordered);
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: abbreviations.
+// -----------------------------------------------------------------------------
+
+
+// A trie of names. Edges live in a single hash table keyed by (node, byte), so
+// each step of a lookup is O(1) and a lookup is O(length of the prefix). Each
+// node records the target (flag, option or command) of the first name through
+// it and whether names with other targets share the node, so a prefix is
+// unique if its node isn't mixed. Aliases share a target, so a prefix of two
+// aliases of the same option isn't ambiguous.
+struct args::NameIndex {
+    struct Node {
+        size_t target;
+        size_t name;
+        bool mixed;
+    };
+
+    vector<Node> nodes;
+    unordered_map<uint64_t, size_t> edges;
+    vector<string const*> names;
+
+    NameIndex() {
+        Node root = {0, 0, true};
+        nodes.push_back(root);
+    }
+
+    void insert(string const& name, size_t target) {
+        size_t node = 0;
+        names.push_back(&name);
+        for (unsigned char c: name) {
+            uint64_t key = (uint64_t(node) << 8) | c;
+            auto iter = edges.find(key);
+            if (iter == edges.end()) {
+                Node child = {target, names.size() - 1, false};
+                nodes.push_back(child);
+                iter = edges.insert(make_pair(key, nodes.size() - 1)).first;
+            } else if (nodes[iter->second].target != target) {
+                nodes[iter->second].mixed = true;
+            }
+            node = iter->second;
+        }
+    }
+
+    // Returns the name [prefix] uniquely abbreviates, or nullptr. Sets
+    // [ambiguous] if it abbreviates several.
+    string const* find(string const& prefix, bool& ambiguous) const {
+        size_t node = 0;
+        ambiguous = false;
+        for (unsigned char c: prefix) {
+            auto iter = edges.find((uint64_t(node) << 8) | c);
+            if (iter == edges.end()) {
+                return nullptr;
+            }
+            node = iter->second;
+        }
+        if (nodes[node].mixed) {
+            ambiguous = node != 0;
+            return nullptr;
+        }
+        return names[nodes[node].name];
+    }
+
+    // The names beginning with [prefix], sorted. Only used for error messages.
+    string candidates(string const& prefix, string const& dashes) const {
+        vector<string> matches;
+        for (string const* name: names) {
+            if (name->compare(0, prefix.size(), prefix) == 0) {
+                matches.push_back(dashes + *name);
+            }
+        }
+        sort(matches.begin(), matches.end());
+        string result;
+        for (string const& match: matches) {
+            result += (result.empty() ? "" : ", ") + match;
+        }
+        return result;
+    }
+};
+
+
+void ArgParser::setAbbreviations(bool enabled) {
+    abbreviations = enabled;
+    for (auto& element: commands) {
+        element.second->setAbbreviations(enabled);
+    }
+}
+
+
+// Expand an abbreviated long option name to the flag or option name it
+// uniquely prefixes, or with [options_only] to the option name. Single-
+// character names are short options and can't be abbreviated. Returns an
+// empty string if there's no match. If the abbreviation is ambiguous, reports
+// an error listing the candidates and sets [ambiguous].
+string ArgParser::expandOption(
+    string const& prefix,
+    string const& dashes,
+    bool& ambiguous,
+    bool options_only) {
+
+    NameIndex*& index = options_only ? value_index : option_index;
+    if (index == nullptr) {
+        index = new NameIndex();
+        if (!options_only) {
+            for (auto const& element: flags) {
+                if (element.first.size() > 1) {
+                    index->insert(element.first, element.second);
+                }
+            }
+        }
+        unordered_map<Option*, size_t> targets;
+        for (auto const& element: options) {
+            if (element.first.size() > 1) {
+                size_t target = flag_counts.size() + targets.size();
+                target = targets.insert(make_pair(element.second, target)).first->second;
+                index->insert(element.first, target);
+            }
+        }
+    }
+
+    string const* name = index->find(prefix, ambiguous);
+    if (ambiguous) {
+        reportError(dashes + prefix + " is ambiguous: " + index->candidates(prefix, dashes) + ".");
+    }
+    return name ? *name : string();
+}
+
+
+// Expand an abbreviated command name. As for expandOption().
+string ArgParser::expandCommand(string const& prefix, bool& ambiguous) {
+    if (command_index == nullptr) {
+        command_index = new NameIndex();
+        unordered_map<ArgParser*, size_t> targets;
+        for (auto const& element: commands) {
+            size_t target = targets.size();
+            target = targets.insert(make_pair(element.second, target)).first->second;
+            command_index->insert(element.first, target);
+        }
+    }
+
+    string const* name = command_index->find(prefix, ambiguous);
+    if (ambiguous) {
+        reportError("'" + prefix + "' is ambiguous: " + command_index->candidates(prefix, "") + ".");
+    }
+    return name ? *name : string();
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: suggestions.
+// -----------------------------------------------------------------------------
+
+
+// Levenshtein distance from a fixed word to any number of candidates, using
+// Myers' bit-parallel algorithm (in Hyyrö's formulation for edit distance).
+// Each column of the dynamic-programming matrix is held as bit vectors of
+// vertical deltas, so a candidate costs O(length) word operations. Words
+// longer than 64 characters fall back to the classic two-row algorithm.
+namespace {
+class EditDistance {
+    public:
+        explicit EditDistance(string const& word) : word(word) {
+            memset(peq, 0, sizeof(peq));
+            for (size_t i = 0; i < word.size() && i < 64; i++) {
+                peq[static_cast<unsigned char>(word[i])] |= uint64_t(1) << i;
+            }
+        }
+
+        size_t distance(string const& text) const {
+            size_t m = word.size();
+            if (m == 0 || m > 64) {
+                return classic(text);
+            }
+            uint64_t last = uint64_t(1) << (m - 1);
+            uint64_t pv = ~uint64_t(0);
+            uint64_t mv = 0;
+            size_t score = m;
+            for (unsigned char c: text) {
+                uint64_t eq = peq[c];
+                uint64_t xv = eq | mv;
+                uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+                uint64_t ph = mv | ~(xh | pv);
+                uint64_t mh = pv & xh;
+                if (ph & last) {
+                    score++;
+                } else if (mh & last) {
+                    score--;
+                }
+                ph = (ph << 1) | 1;
+                mh = mh << 1;
+                pv = mh | ~(xv | ph);
+                mv = ph & xv;
+            }
+            return score;
+        }
+
+    private:
+        string const& word;
+        uint64_t peq[256];
+
+        size_t classic(string const& text) const {
+            vector<size_t> row(text.size() + 1);
+            for (size_t j = 0; j <= text.size(); j++) {
+                row[j] = j;
+            }
+            for (size_t i = 1; i <= word.size(); i++) {
+                size_t diagonal = row[0];
+                row[0] = i;
+                for (size_t j = 1; j <= text.size(); j++) {
+                    size_t above = row[j];
+                    size_t cost = word[i - 1] == text[j - 1] ? 0 : 1;
+                    row[j] = min(min(row[j] + 1, row[j - 1] + 1), diagonal + cost);
+                    diagonal = above;
+                }
+            }
+            return row[text.size()];
+        }
 };
+}
+
+
+// Collect the names in [names] closest to [word], keeping only those at the
+// smallest distance found so far. Names whose length differs from the word's
+// by more than the limit can't be within it and are skipped without scoring.
+template<typename Map>
+static void closestNames(
+    Map const& names,
+    EditDistance const& metric,
+    size_t length,
+    size_t& limit,
+    vector<string>& best) {
+
+    for (auto const& element: names) {
+        string const& name = element.first;
+        if (name.size() < 2 || max(name.size(), length) - min(name.size(), length) > limit) {
+            continue;
+        }
+        size_t distance = metric.distance(name);
+        if (distance < limit) {
+            limit = distance;
+            best.clear();
+        }
+        if (distance == limit) {
+            best.push_back(name);
+        }
+    }
+}
+
+
+// Return a ' Did you mean ...?' hint for an unrecognised long option or
+// command name, or an empty string if no registered name is close. With
+// [options_only], flags aren't suggested. The word itself is never suggested.
+// Only called on the error path, so it costs nothing when parsing succeeds.
+string ArgParser::suggest(
+    string const& word,
+    string const& dashes,
+    bool command,
+    bool options_only) const {
+
+    EditDistance metric(word);
+    size_t limit = max<size_t>(1, min<size_t>(3, word.size() / 3));
+    vector<string> best;
+    if (command) {
+        closestNames(commands, metric, word.size(), limit, best);
+    } else {
+        if (!options_only) {
+            closestNames(flags, metric, word.size(), limit, best);
+        }
+        closestNames(options, metric, word.size(), limit, best);
+    }
+    best.erase(remove(best.begin(), best.end(), word), best.end());
+    if (best.empty()) {
+        return string();
+    }
+
+    sort(best.begin(), best.end());
+    best.erase(unique(best.begin(), best.end()), best.end());
+    string hint = " Did you mean ";
+    for (size_t i = 0; i < best.size() && i < 3; i++) {
+        if (i > 0) {
+            hint += i + 1 == min<size_t>(best.size(), 3) ? " or " : ", ";
+        }
+        hint += command ? "'" + best[i] + "'" : dashes + best[i];
+    }
+    return hint + "?";
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: setup.
+// -----------------------------------------------------------------------------
+
+
+void ArgParser::flag(string const& name) {
+    delete option_index;
+    option_index = nullptr;
+    size_t id = flag_counts.size();
+    vector<string> aliases = splitAliases(name);
+    flag_counts.push_back(0);
+    config_flag_counts.push_back(0);
+    flag_identities.push_back(identityHash(aliases, 'f'));
+    for (string const& alias: aliases) {
+        flags[alias] = id;
+    }
+}
+
+
+void ArgParser::option(string const& name, string const& fallback) {
+    delete option_index;
+    delete value_index;
+    option_index = nullptr;
+    value_index = nullptr;
+    Option* option = new Option();
+    vector<string> aliases = splitAliases(name);
+    option->fallback = fallback;
+    option->identity = identityHash(aliases, 'o');
+    for (string const& alias: aliases) {
+        options[alias] = option;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: map options.
+// -----------------------------------------------------------------------------
+
+
+// The keys of a map option, indexed in an open-addressing hash table. Keys and
+// values aren't copied: each slot holds spans of the 'key=value' string the
+// parser has already stored in its arena. Clearing keeps the table's capacity.
+struct args::MapIndex {
+    struct Slot {
+        uint64_t hash;
+        Span key;
+        Span value;
+        bool used;
+    };
+
+    string name;
+    vector<Slot> slots;
+    size_t count;
+
+    MapIndex() : count(0) {}
+
+    // Find the slot for [key]: either the slot holding it or the empty slot
+    // where it belongs. The table is never more than half full.
+    Slot& probe(string const& arena, char const* key, size_t length, uint64_t hash) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (!slot.used) {
+                return slot;
+            }
+            if (slot.hash == hash && slot.key.length == length
+                && memcmp(arena.data() + slot.key.offset, key, length) == 0) {
+                return slot;
+            }
+        }
+    }
+
+    Slot const* find(string const& arena, string const& key) const {
+        if (count == 0) {
+            return nullptr;
+        }
+        uint64_t hash = hashBytes(key.data(), key.size());
+        Slot const& slot = const_cast<MapIndex*>(this)->probe(arena, key.data(), key.size(), hash);
+        return slot.used ? &slot : nullptr;
+    }
+
+    // Later values for a key replace earlier ones.
+    void insert(string const& arena, Span key, Span value) {
+        if (2 * (count + 1) > slots.size()) {
+            grow(arena);
+        }
+        char const* text = arena.data() + key.offset;
+        uint64_t hash = hashBytes(text, key.length);
+        Slot& slot = probe(arena, text, key.length, hash);
+        if (!slot.used) {
+            count++;
+        }
+        slot.hash = hash;
+        slot.key = key;
+        slot.value = value;
+        slot.used = true;
+    }
+
+    void grow(string const& arena) {
+        vector<Slot> old;
+        old.swap(slots);
+        Slot empty = {0, {0, 0}, {0, 0}, false};
+        slots.assign(max<size_t>(8, old.size() * 2), empty);
+        for (Slot const& slot: old) {
+            if (slot.used) {
+                char const* text = arena.data() + slot.key.offset;
+                probe(arena, text, slot.key.length, slot.hash) = slot;
+            }
+        }
+    }
+
+    void clear() {
+        if (count > 0) {
+            for (Slot& slot: slots) {
+                slot.used = false;
+            }
+            count = 0;
+        }
+    }
+
+    // A value must have a non-empty key before its first '='.
+    static bool accepts(char const* value, size_t length) {
+        char const* equals = static_cast<char const*>(memchr(value, '=', length));
+        return equals != nullptr && equals != value;
+    }
+
+    string invalid(string const& value, string const& source = "") const {
+        return "invalid value '" + value + "' for " + name + source + ": expected key=value.";
+    }
+};
+
+
+static string dashedName(string const& name) {
+    return (name.size() == 1 ? "-" : "--") + name;
+}
+
+
+// Register an option whose values are 'key=value' pairs.
+void ArgParser::mapOption(string const& name) {
+    option(name);
+    vector<string> aliases = splitAliases(name);
+    if (!aliases.empty()) {
+        MapIndex* map = new MapIndex();
+        map->name = dashedName(aliases[0]);
+        options[aliases[0]]->map = map;
+    }
+}
+
+
+// Index a map option's value, which has just been stored in the arena as
+// [span]. The value is split on its first '='.
+void ArgParser::indexMapValue(Option* option, Span const& span) {
+    char const* text = arena.data() + span.offset;
+    char const* equals = static_cast<char const*>(memchr(text, '=', span.length));
+    size_t key_length = equals ? equals - text : 0;
+    Span key = {span.offset, key_length};
+    Span value = {span.offset + key_length + 1, span.length - key_length - 1};
+    option->map->insert(arena, key, value);
+}
+
+
+// Find the value for [key] among a map option's values. As for value(), the
+// command line's values take precedence over the environment's, which take
+// precedence over the config file's, which take precedence over the fallback.
+// Only the command line can give several pairs; the others give one each.
+bool ArgParser::findKey(Option const* option, string const& key, string* value) const {
+    if (option->values.size() > 0) {
+        MapIndex::Slot const* slot = option->map->find(arena, key);
+        if (slot != nullptr && value != nullptr) {
+            *value = text(slot->value);
+        }
+        return slot != nullptr;
+    }
+    string const& pair = option->has_env ? option->env
+        : option->configured() ? option->config : option->fallback;
+    if (pair.size() <= key.size() || pair[key.size()] != '=' || key.find('=') != string::npos
+        || pair.compare(0, key.size(), key) != 0) {
+        return false;
+    }
+    if (value != nullptr) {
+        value->assign(pair, key.size() + 1, string::npos);
+    }
+    return true;
+}
+
+
+// Return the last value given for [key] by the named map option, or an empty
+// string if the key wasn't given.
+string ArgParser::lookup(string const& name, string const& key) const {
+    string result;
+    auto iter = options.find(name);
+    if (iter != options.end() && iter->second->map != nullptr) {
+        findKey(iter->second, key, &result);
+    }
+    return result;
+}
+
+
+bool ArgParser::hasKey(string const& name, string const& key) const {
+    auto iter = options.find(name);
+    if (iter == options.end() || iter->second->map == nullptr) {
+        return false;
+    }
+    return findKey(iter->second, key, nullptr);
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: retrieve values.
+// -----------------------------------------------------------------------------
+
+
+// The accessors below are const and never modify the parser's maps, so once
+// parse() has returned they can be called concurrently from any number of
+// threads without locking.
+bool ArgParser::found(string const& name) const {
+    return count(name) > 0;
+}
+
+
+// Values from environment variables and config files count as found unless
+// the flag or option was also found on the command line, in which case they're
+// ignored. Environment variables take precedence over config files.
+int ArgParser::count(string const& name) const {
+    auto flag_iter = flags.find(name);
+    if (flag_iter != flags.end()) {
+        int count = flag_counts[flag_iter->second];
+        return count > 0 ? count : config_flag_counts[flag_iter->second];
+    }
+    auto option_iter = options.find(name);
+    if (option_iter != options.end()) {
+        Option const* option = option_iter->second;
+        if (option->values.size() > 0) {
+            return option->values.size();
+        }
+        return option->has_env || option->configured() ? 1 : 0;
+    }
+    return 0;
+}
+
+
+string ArgParser::value(string const& name) const {
+    auto iter = options.find(name);
+    if (iter != options.end()) {
+        Option const* option = iter->second;
+        if (option->values.size() > 0) {
+            return text(option->values.back());
+        }
+        if (option->has_env) {
+            return option->env;
+        }
+        if (option->configured()) {
+            return option->config;
+        }
+        return option->fallback;
+    }
+    return string();
+}
+
+
+vector<string> ArgParser::values(string const& name) const {
+    vector<string> result;
+    auto iter = options.find(name);
+    if (iter != options.end()) {
+        Option const* option = iter->second;
+        result.reserve(option->values.size());
+        for (size_t i = 0; i < option->values.size(); i++) {
+            result.push_back(text(option->values[i]));
+        }
+        if (result.empty() && option->has_env) {
+            result.push_back(option->env);
+        } else if (result.empty() && option->configured()) {
+            result.push_back(option->config);
+        }
+    }
+    return result;
+}
+
+
+// Move the positional arguments out of the parser, leaving its list empty.
+vector<string> ArgParser::takeArgs() {
+    vector<string> result;
+    result.swap(args);
+    return result;
+}
+
+
+// Return the specified option's list of values and clear it from the parser.
+// The option then behaves as if it had not been found.
+vector<string> ArgParser::takeValues(string const& name) {
+    vector<string> result = values(name);
+    auto iter = options.find(name);
+    if (iter != options.end()) {
+        iter->second->values.clear();
+        iter->second->has_env = false;
+        iter->second->taken = true;
+        if (iter->second->map != nullptr) {
+            iter->second->map->clear();
+        }
+    }
+    return result;
+}
+
+
+// Publish a new value for the specified option. Returns false if the option
+// isn't registered. Writers are serialized against each other and wait for a
+// grace period before freeing the previous value; readers are never blocked.
+bool ArgParser::setLiveValue(string const& name, string const& value) {
+    auto iter = options.find(name);
+    if (iter == options.end()) {
+        return false;
+    }
+    publish(iter->second, value);
+    return true;
+}
+
+
+// Return the parser's live domain, creating it if necessary.
+LiveDomain* ArgParser::liveDomain() {
+    LiveDomain* domain = live_domain.load();
+    if (domain == nullptr) {
+        LiveDomain* fresh = new LiveDomain();
+        if (live_domain.compare_exchange_strong(domain, fresh)) {
+            domain = fresh;
+        } else {
+            delete fresh;
+        }
+    }
+    return domain;
+}
+
+
+void ArgParser::publish(Option* option, string const& value) {
+    LiveDomain* domain = liveDomain();
+    lock_guard<mutex> guard(domain->writer);
+    string const* previous = option->live.exchange(new string(value));
+    domain->synchronize();
+    delete previous;
+}
+
+
+// Return the most recently published value for the specified option, or its
+// parsed value if no value has been published. Never blocks.
+string ArgParser::liveValue(string const& name) const {
+    auto iter = options.find(name);
+    if (iter == options.end()) {
+        return string();
+    }
+
+    LiveDomain* domain = live_domain.load();
+    if (domain == nullptr) {
+        return value(name);
+    }
+
+    unsigned epoch = domain->enter();
+    string const* current = iter->second->live.load();
+    string result = current ? *current : value(name);
+    domain->leave(epoch);
+    return result;
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: constraints.
+// -----------------------------------------------------------------------------
+
+
+// Each constrained flag or option is given a bit. After a parse we build a
+// presence bitset with one O(1) check per bit -- no name lookups -- and then
+// evaluate every constraint as mask operations over it.
+struct args::Constraints {
+    vector<Option*> options;
+    vector<size_t> flag_ids;
+    vector<string> names;
+    vector<uint64_t> required;
+    vector<vector<uint64_t>> exclusive;
+    vector<pair<size_t, size_t>> dependencies;
+    unordered_map<size_t, size_t> flag_bits;
+    unordered_map<Option*, size_t> option_bits;
+    vector<uint64_t> presence;
+};
+
+
+static void setBit(vector<uint64_t>& mask, size_t bit) {
+    if (mask.size() <= bit / 64) {
+        mask.resize(bit / 64 + 1, 0);
+    }
+    mask[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+
+static bool testBit(vector<uint64_t> const& mask, size_t bit) {
+    return bit / 64 < mask.size() && (mask[bit / 64] >> (bit % 64)) & 1;
+}
+
+
+Constraints& ArgParser::constraintSet() {
+    if (constraints == nullptr) {
+        constraints = new Constraints();
+    }
+    return *constraints;
+}
+
+
+// Return the bit for the named flag or option, assigning one if necessary.
+// Returns -1 if the name isn't registered.
+long ArgParser::constraintBit(string const& name) {
+    Constraints& c = constraintSet();
+    Option* option = nullptr;
+    size_t flag_id = 0;
+    size_t bit = c.names.size();
+
+    auto flag_iter = flags.find(name);
+    auto option_iter = options.find(name);
+    if (flag_iter != flags.end()) {
+        flag_id = flag_iter->second;
+        auto result = c.flag_bits.insert(make_pair(flag_id, bit));
+        if (!result.second) {
+            return result.first->second;
+        }
+    } else if (option_iter != options.end()) {
+        option = option_iter->second;
+        auto result = c.option_bits.insert(make_pair(option, bit));
+        if (!result.second) {
+            return result.first->second;
+        }
+    } else {
+        return -1;
+    }
+
+    c.options.push_back(option);
+    c.flag_ids.push_back(flag_id);
+    c.names.push_back(name);
+    return bit;
+}
+
+
+// Require the named flag or option to be found. Values from environment
+// variables and config files count. Returns false if the name isn't
+// registered.
+bool ArgParser::require(string const& name) {
+    long bit = constraintBit(name);
+    if (bit < 0) {
+        return false;
+    }
+    setBit(constraints->required, bit);
+    return true;
+}
+
+
+// Allow at most one of a space-separated list of flags and options to be
+// found. Returns false, registering nothing, if any name isn't registered or
+// fewer than two names are given.
+bool ArgParser::exclusive(string const& names) {
+    vector<string> list = splitAliases(names);
+    if (list.size() < 2) {
+        return false;
+    }
+    vector<uint64_t> group;
+    for (string const& name: list) {
+        long bit = constraintBit(name);
+        if (bit < 0) {
+            return false;
+        }
+        setBit(group, bit);
+    }
+    constraints->exclusive.push_back(group);
+    return true;
+}
+
+
+// Require [other] to be found whenever [name] is found. Returns false if
+// either name isn't registered.
+bool ArgParser::depends(string const& name, string const& other) {
+    long bit = constraintBit(name);
+    long other_bit = constraintBit(other);
+    if (bit < 0 || other_bit < 0) {
+        return false;
+    }
+    constraints->dependencies.push_back(make_pair(bit, other_bit));
+    return true;
+}
+
+
+// Check the constraints against the parse result, reporting each violation.
+void ArgParser::checkConstraints() {
+    Constraints& c = *constraints;
+    size_t words = (c.names.size() + 63) / 64;
+    c.presence.assign(words, 0);
+    for (size_t bit = 0; bit < c.names.size(); bit++) {
+        Option const* option = c.options[bit];
+        bool found;
+        if (option != nullptr) {
+            found = option->values.size() > 0 || option->has_env || option->configured();
+        } else {
+            found = flag_counts[c.flag_ids[bit]] > 0 || config_flag_counts[c.flag_ids[bit]] > 0;
+        }
+        if (found) {
+            c.presence[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+
+    for (size_t i = 0; i < c.required.size(); i++) {
+        uint64_t missing = c.required[i] & ~c.presence[i];
+        for (size_t bit = i * 64; missing != 0; bit++, missing >>= 1) {
+            if (missing & 1) {
+                reportError(dashedName(c.names[bit]) + " is required.");
+            }
+        }
+    }
+
+    for (vector<uint64_t> const& group: c.exclusive) {
+        size_t count = 0;
+        for (size_t i = 0; i < group.size(); i++) {
+            uint64_t both = group[i] & c.presence[i];
+            for (; both != 0; both &= both - 1) {
+                count++;
+            }
+        }
+        if (count > 1) {
+            string found;
+            for (size_t bit = 0; bit < c.names.size(); bit++) {
+                if (testBit(group, bit) && testBit(c.presence, bit)) {
+                    found += (found.empty() ? "" : ", ") + dashedName(c.names[bit]);
+                }
+            }
+            reportError(found + " can't be used together.");
+        }
+    }
+
+    for (auto const& dependency: c.dependencies) {
+        if (testBit(c.presence, dependency.first) && !testBit(c.presence, dependency.second)) {
+            reportError(dashedName(c.names[dependency.first]) + " requires "
+                + dashedName(c.names[dependency.second]) + ".");
+        }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: choice options.
+// -----------------------------------------------------------------------------
+
+
+// A choice option's list of choices, matched through a perfect hash built at
+// registration by hash-and-displace. Each choice's hash picks a bucket, and
+// each bucket stores a displacement which, mixed into the hash, sends every
+// choice in the bucket to its own slot. A lookup is one hash, one mix and one
+// string comparison however many choices there are, and the tables take a few
+// bytes per choice.
+struct args::ChoiceSet {
+    string name;
+    vector<string> choices;
+    vector<uint32_t> displacements;
+    vector<int> slots;
+    uint64_t seed;
+
+    size_t slotOf(uint64_t hash, uint32_t displacement) const {
+        return mixHash(hash ^ (displacement * 0x9e3779b97f4a7c15ULL)) % slots.size();
+    }
+
+    // Returns the index of [value] in the list of choices, or -1.
+    int find(char const* value, size_t length) const {
+        uint64_t hash = hashBytes(value, length, seed);
+        int index = slots[slotOf(hash, displacements[hash % displacements.size()])];
+        if (index < 0 || choices[index].size() != length) {
+            return -1;
+        }
+        return memcmp(choices[index].data(), value, length) == 0 ? index : -1;
+    }
+
+    int find(string const& value) const {
+        return find(value.data(), value.size());
+    }
+
+    // Try seeds until one gives a table. A seed fails only if two choices'
+    // 64-bit hashes collide or a bucket can't be placed, both of which are
+    // vanishingly rare.
+    void build() {
+        for (seed = 0; !tryBuild(); seed++) {}
+    }
+
+    // Buckets average four choices and the slot table is about 80% full.
+    // Buckets are placed largest first, each trying displacements until all
+    // its choices land in free slots. Duplicate choices share the first one's
+    // slot.
+    bool tryBuild() {
+        size_t bucket_count = max<size_t>(1, (choices.size() + 3) / 4);
+        displacements.assign(bucket_count, 0);
+        slots.assign(choices.size() + choices.size() / 4 + 1, -1);
+
+        vector<vector<pair<uint64_t, int>>> buckets(bucket_count);
+        for (size_t i = 0; i < choices.size(); i++) {
+            uint64_t hash = hashBytes(choices[i].data(), choices[i].size(), seed);
+            auto& bucket = buckets[hash % bucket_count];
+            bool duplicate = false;
+            for (auto const& entry: bucket) {
+                if (entry.first == hash) {
+                    if (choices[entry.second] != choices[i]) {
+                        return false;
+                    }
+                    duplicate = true;
+                }
+            }
+            if (!duplicate) {
+                bucket.push_back(make_pair(hash, int(i)));
+            }
+        }
+
+        vector<size_t> order(bucket_count);
+        for (size_t i = 0; i < bucket_count; i++) {
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        vector<size_t> placed;
+        for (size_t b: order) {
+            auto const& bucket = buckets[b];
+            if (bucket.empty()) {
+                break;
+            }
+            uint32_t displacement = 0;
+            for (; displacement < (1u << 20); displacement++) {
+                placed.clear();
+                for (auto const& entry: bucket) {
+                    size_t slot = slotOf(entry.first, displacement);
+                    if (slots[slot] >= 0 || std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+                        break;
+                    }
+                    placed.push_back(slot);
+                }
+                if (placed.size() == bucket.size()) {
+                    break;
+                }
+            }
+            if (placed.size() != bucket.size()) {
+                return false;
+            }
+            displacements[b] = displacement;
+            for (size_t i = 0; i < bucket.size(); i++) {
+                slots[placed[i]] = bucket[i].second;
+            }
+        }
+        return true;
+    }
+
+    // The error message for an invalid value, with an optional note of where
+    // the value came from.
+    string invalid(string const& value, string const& source = "") const {
+        string list;
+        for (size_t i = 0; i < choices.size(); i++) {
+            list += (i == 0 ? "" : i + 1 == choices.size() ? " or " : ", ") + choices[i];
+        }
+        return "invalid value '" + value + "' for " + name + source + ": expected " + list + ".";
+    }
+};
+
+
+Option::~Option() {
+    delete live.load();
+    delete choices;
+    delete map;
+}
+
+
+// Register an option whose value must be one of a space-separated list of
+// choices. Invalid values are reported as parse errors.
+void ArgParser::choice(string const& name, string const& choices, string const& fallback) {
+    option(name, fallback);
+    vector<string> aliases = splitAliases(name);
+    if (aliases.empty()) {
+        return;
+    }
+    ChoiceSet* set = new ChoiceSet();
+    set->name = dashedName(aliases[0]);
+    set->choices = splitAliases(choices);
+    set->build();
+    options[aliases[0]]->choices = set;
+}
+
+
+// Return the index of the named choice option's value in its list of choices.
+// Returns -1 if the value (e.g. an empty fallback) isn't one of the choices or
+// the name isn't a choice option. Values found on the command line are
+// matched as they're parsed; other values are matched here.
+int ArgParser::choiceIndex(string const& name) const {
+    auto iter = options.find(name);
+    if (iter == options.end() || iter->second->choices == nullptr) {
+        return -1;
+    }
+    Option const* option = iter->second;
+    if (option->values.size() > 0) {
+        return option->choice;
+    }
+    if (option->has_env) {
+        return option->choices->find(option->env);
+    }
+    if (option->configured()) {
+        return option->choices->find(option->config);
+    }
+    return option->choices->find(option->fallback);
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: environment variables.
+// -----------------------------------------------------------------------------
+
+
+// Bind an option to an environment variable. Returns false if the option isn't
+// registered. The parser is added to its own and its ancestors' lists of bound
+// parsers.
+bool ArgParser::env(string const& name, string const& variable) {
+    auto iter = options.find(name);
+    if (iter == options.end()) {
+        return false;
+    }
+    uint64_t hash = hashBytes(variable.data(), variable.size());
+    env_bindings.insert(make_pair(hash, make_pair(variable, iter->second)));
+    for (ArgParser* ancestor = this; ancestor != nullptr; ancestor = ancestor->parent) {
+        vector<ArgParser*>& bound = ancestor->env_parsers;
+        if (find(bound.begin(), bound.end(), this) == bound.end()) {
+            bound.push_back(this);
+        }
+    }
+    return true;
+}
+
+
+// Resolve the environment variables bound by this parser and its commands.
+// Rather than calling getenv() for each binding, which scans the environment
+// each time, we scan the environment once and look each variable up in the
+// bound parsers' hash tables. Nothing is allocated unless a value is longer
+// than the one it replaces. Invalid choices are reported against this parser,
+// so they appear in its errors().
+void ArgParser::resolveEnv() {
+    if (env_parsers.empty()) {
+        return;
+    }
+
+    for (char** entry = environ; *entry != nullptr; entry++) {
+        char const* equals = strchr(*entry, '=');
+        if (equals == nullptr) {
+            continue;
+        }
+        size_t length = equals - *entry;
+        uint64_t hash = hashBytes(*entry, length);
+        for (ArgParser* parser: env_parsers) {
+            auto range = parser->env_bindings.equal_range(hash);
+            for (auto iter = range.first; iter != range.second; ++iter) {
+                string const& variable = iter->second.first;
+                if (variable.size() == length && memcmp(variable.data(), *entry, length) == 0) {
+                    Option* option = iter->second.second;
+                    size_t value_length = strlen(equals + 1);
+                    if (option->choices != nullptr && option->choices->find(equals + 1, value_length) < 0) {
+                        reportError(option->choices->invalid(equals + 1, " from $" + variable));
+                        continue;
+                    }
+                    if (option->map != nullptr && !MapIndex::accepts(equals + 1, value_length)) {
+                        reportError(option->map->invalid(equals + 1, " from $" + variable));
+                        continue;
+                    }
+                    option->env.assign(equals + 1);
+                    option->has_env = true;
+                }
+            }
+        }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: config files.
+// -----------------------------------------------------------------------------
+
+
+// A read-only view of a file's contents. The file is memory-mapped where the
+// platform supports it so large files are read in a single pass with no copy.
+// A mapping faults with SIGBUS if another process truncates the file while it
+// is being read, so readers of files which may be rewritten under them can ask
+// for the contents to be read into a buffer instead.
+class args::MappedFile {
+    public:
+        explicit MappedFile(string const& path, bool map = true);
+        ~MappedFile();
+
+        bool ok;
+        char const* data;
+        size_t size;
+
+    private:
+        bool mapped;
+        string buffer;
+};
+
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(string const& path, bool map) : ok(false), data(nullptr), size(0), mapped(false) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return;
+    }
+    char chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        buffer.append(chunk, count);
+    }
+    ok = !ferror(file);
+    fclose(file);
+    data = buffer.data();
+    size = buffer.size();
+}
+
+
+MappedFile::~MappedFile() {}
+
+#else
+
+MappedFile::MappedFile(string const& path, bool map) : ok(false), data(nullptr), size(0), mapped(false) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (!map) {
+        char chunk[4096];
+        ssize_t count;
+        while ((count = read(fd, chunk, sizeof(chunk))) != 0) {
+            if (count < 0 && errno != EINTR) {
+                break;
+            }
+            if (count > 0) {
+                buffer.append(chunk, count);
+            }
+        }
+        ok = count == 0;
+        data = buffer.data();
+        size = buffer.size();
+    } else if (fstat(fd, &info) == 0) {
+        size = info.st_size;
+        if (size == 0) {
+            ok = true;
+        } else {
+            void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                madvise(address, size, MADV_SEQUENTIAL);
+                data = static_cast<char const*>(address);
+                ok = mapped = true;
+            }
+        }
+    }
+    close(fd);
+}
+
+
+MappedFile::~MappedFile() {
+    if (mapped) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+#endif
+
+
+static char const* skipSpace(char const* start, char const* end) {
+    while (start < end && isspace(static_cast<unsigned char>(*start))) {
+        start++;
+    }
+    return start;
+}
+
+
+static char const* trimSpace(char const* start, char const* end) {
+    while (end > start && isspace(static_cast<unsigned char>(end[-1]))) {
+        end--;
+    }
+    return end;
+}
+
+
+// Returns 1 or 0 for a valid flag value in a config file, -1 otherwise.
+static int parseFlagValue(string const& value) {
+    if (value == "true" || value == "yes" || value == "on" || value == "1") {
+        return 1;
+    }
+    if (value == "false" || value == "no" || value == "off" || value == "0") {
+        return 0;
+    }
+    return -1;
+}
+
+
+// Scan a config file in a single pass, calling handler(key, value) for each
+// entry. The handler returns an error message or an empty string. Returns the
+// first error, prefixed with the file name and line number.
+template<typename Handler>
+static string scanConfig(MappedFile const& file, string const& path, Handler handler) {
+    char const* cursor = file.data;
+    char const* end = file.data + file.size;
+    size_t line_number = 0;
+    string key;
+    string value;
+
+    while (cursor < end) {
+        char const* newline = static_cast<char const*>(memchr(cursor, '\n', end - cursor));
+        char const* line_end = newline ? newline : end;
+        char const* start = skipSpace(cursor, line_end);
+        char const* stop = trimSpace(start, line_end);
+        cursor = line_end + 1;
+        line_number++;
+
+        if (start == stop || *start == '#' || *start == ';') {
+            continue;
+        }
+
+        string error;
+        char const* equals = static_cast<char const*>(memchr(start, '=', stop - start));
+        if (equals == nullptr || equals == start) {
+            error = "expected 'key = value'.";
+        } else {
+            key.assign(start, trimSpace(start, equals));
+            char const* value_start = skipSpace(equals + 1, stop);
+            if (stop - value_start >= 2 && *value_start == '"' && stop[-1] == '"') {
+                value.assign(value_start + 1, stop - 1);
+            } else {
+                value.assign(value_start, stop);
+            }
+            error = handler(key, value);
+        }
+
+        if (!error.empty()) {
+            return path + ":" + to_string(line_number) + ": " + error;
+        }
+    }
+
+    return string();
+}
+
+
+// Load flag and option values from a config file. Each non-blank line has the
+// form 'key = value', where the key is any registered name for a flag or
+// option. Lines beginning with '#' or ';' are comments. Flags take the values
+// true/false, yes/no, on/off, or 1/0. Returns false if the file can't be read;
+// exits with an error message if the file contains an invalid line.
+bool ArgParser::loadConfig(string const& path) {
+    MappedFile file(path);
+    if (!file.ok) {
+        return false;
+    }
+
+    string error = scanConfig(file, path, [this](string const& key, string const& value) {
+        return setConfigValue(key, value);
+    });
+    if (!error.empty()) {
+        exitError(error);
+    }
+
+    config_path = path;
+    return true;
+}
+
+
+string ArgParser::setConfigValue(string const& key, string const& value) {
+    auto option_iter = options.find(key);
+    if (option_iter != options.end()) {
+        ChoiceSet const* choices = option_iter->second->choices;
+        if (choices != nullptr && choices->find(value) < 0) {
+            return choices->invalid(value);
+        }
+        MapIndex const* map = option_iter->second->map;
+        if (map != nullptr && !MapIndex::accepts(value.data(), value.size())) {
+            return map->invalid(value);
+        }
+        option_iter->second->config = value;
+        option_iter->second->has_config = true;
+        return string();
+    }
+
+    auto flag_iter = flags.find(key);
+    if (flag_iter != flags.end()) {
+        int count = parseFlagValue(value);
+        if (count < 0) {
+            return "invalid value '" + value + "' for flag '" + key + "'.";
+        }
+        config_flag_counts[flag_iter->second] = count;
+        return string();
+    }
+
+    return "'" + key + "' is not a recognised flag or option.";
+}
+
+
+// Re-read the config file most recently loaded by loadConfig(). Options whose
+// effective value has changed -- i.e. options not overridden on the command
+// line or by the environment whose file value was added, changed or removed --
+// have their new value published as a live value; unchanged options are left
+// alone. Values returned by value() and flags are not affected. If the file
+// can't be read or is invalid, an error is printed to stderr, nothing is
+// published, and the method returns false. Safe to call while other threads
+// read live values. The file is read rather than mapped, since it may be
+// rewritten by another process while we read it.
+bool ArgParser::reloadConfig() {
+    if (config_path.empty()) {
+        return false;
+    }
+
+    MappedFile file(config_path, false);
+    if (!file.ok) {
+        printError("unable to reload " + config_path + ".");
+        return false;
+    }
+
+    unordered_map<Option*, string> fresh;
+    string error = scanConfig(file, config_path, [&](string const& key, string const& value) -> string {
+        auto option_iter = options.find(key);
+        if (option_iter != options.end()) {
+            ChoiceSet const* choices = option_iter->second->choices;
+            if (choices != nullptr && choices->find(value) < 0) {
+                return choices->invalid(value);
+            }
+            MapIndex const* map = option_iter->second->map;
+            if (map != nullptr && !MapIndex::accepts(value.data(), value.size())) {
+                return map->invalid(value);
+            }
+            fresh[option_iter->second] = value;
+            return string();
+        }
+        auto flag_iter = flags.find(key);
+        if (flag_iter != flags.end()) {
+            if (parseFlagValue(value) < 0) {
+                return "invalid value '" + value + "' for flag '" + key + "'.";
+            }
+            return string();
+        }
+        return "'" + key + "' is not a recognised flag or option.";
+    });
+    if (!error.empty()) {
+        printError(error);
+        return false;
+    }
+
+    lock_guard<mutex> guard(liveDomain()->reloader);
+
+    set<Option*> unique_options;
+    for (auto& element: options) {
+        unique_options.insert(element.second);
+    }
+
+    for (Option* option: unique_options) {
+        if (option->values.size() > 0 || option->has_env) {
+            continue;
+        }
+        string const& previous = option->has_reloaded ? option->reloaded
+            : option->has_config ? option->config : option->fallback;
+        auto iter = fresh.find(option);
+        string const& current = iter != fresh.end() ? iter->second : option->fallback;
+        if (current != previous) {
+            option->reloaded = current;
+            option->has_reloaded = true;
+            publish(option, current);
+        }
+    }
+
+    return true;
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: config file watcher.
+// -----------------------------------------------------------------------------
+
+
+#ifndef _WIN32
+
+// Each active watcher registers the write end of its wakeup pipe here (stored
+// as fd + 1 so that zero means empty). The SIGHUP handler writes a byte to each
+// registered pipe, which is async-signal-safe. The handler is installed while
+// at least one pipe is registered; the previous disposition is restored when
+// the last one is removed.
+static atomic<int> sighup_pipes[16];
+static struct sigaction previous_sighup;
+static mutex sighup_mutex;
+static int sighup_watchers = 0;
+
+
+static void handleSighup(int signal) {
+    int saved_errno = errno;
+    for (auto& slot: sighup_pipes) {
+        int fd = slot.load() - 1;
+        if (fd >= 0) {
+            ssize_t result = write(fd, "h", 1);
+            (void)result;
+        }
+    }
+    bool chain = !(previous_sighup.sa_flags & SA_SIGINFO)
+        && previous_sighup.sa_handler != SIG_DFL
+        && previous_sighup.sa_handler != SIG_IGN;
+    if (chain) {
+        previous_sighup.sa_handler(signal);
+    }
+    errno = saved_errno;
+}
+
+
+// Register a watcher's wakeup pipe. Returns its slot, or -1 if all the slots
+// are taken, in which case the watcher won't hear about SIGHUP.
+static int addSighupPipe(int fd) {
+    lock_guard<mutex> guard(sighup_mutex);
+    for (int i = 0; i < 16; i++) {
+        if (sighup_pipes[i].load() == 0) {
+            sighup_pipes[i].store(fd + 1);
+            if (sighup_watchers++ == 0) {
+                struct sigaction action;
+                memset(&action, 0, sizeof(action));
+                action.sa_handler = handleSighup;
+                action.sa_flags = SA_RESTART;
+                sigemptyset(&action.sa_mask);
+                sigaction(SIGHUP, &action, &previous_sighup);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Unregister a watcher's wakeup pipe. If it was the last, restore the previous
+// SIGHUP disposition, unless the application has since replaced our handler.
+static void removeSighupPipe(int slot) {
+    lock_guard<mutex> guard(sighup_mutex);
+    sighup_pipes[slot].store(0);
+    if (--sighup_watchers == 0) {
+        struct sigaction current;
+        sigaction(SIGHUP, nullptr, &current);
+        if (!(current.sa_flags & SA_SIGINFO) && current.sa_handler == handleSighup) {
+            sigaction(SIGHUP, &previous_sighup, nullptr);
+        }
+    }
+}
+
+
+// A background thread which waits on the watcher's wakeup pipe and, on Linux,
+// an inotify descriptor watching the config file's directory. (Watching the
+// directory rather than the file catches editors that save by renaming a new
+// file into place.) We wait for the writer to close the file or rename it into
+// place; a newly created file is still empty or half written.
+struct args::ConfigWatcher {
+    ArgParser* parser;
+    int pipe_fds[2];
+    int inotify_fd;
+    int slot;
+    string filename;
+    thread worker;
+
+    void run();
+};
+
+
+void ConfigWatcher::run() {
+    alignas(8) char buffer[4096];
+
+    while (true) {
+        struct pollfd fds[2];
+        fds[0].fd = pipe_fds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = inotify_fd;
+        fds[1].events = POLLIN;
+
+        if (poll(fds, inotify_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        bool reload = false;
+
+        if (fds[0].revents & POLLIN) {
+            ssize_t count = read(pipe_fds[0], buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < count; i++) {
+                if (buffer[i] == 'q') {
+                    return;
+                }
+                reload = true;
+            }
+        }
+
+        if (inotify_fd >= 0 && (fds[1].revents & POLLIN)) {
+            ssize_t count = read(inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t i = 0; i < count;) {
+                struct inotify_event* event = reinterpret_cast<struct inotify_event*>(buffer + i);
+                if (event->len > 0 && filename == event->name) {
+                    reload = true;
+                }
+                i += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+        if (reload) {
+            parser->reloadConfig();
+        }
+    }
+}
+
+
+// Start reloading the config file automatically when the process receives
+// SIGHUP or, on Linux, when the file changes. Returns false if no config file
+// has been loaded or the watcher can't be started.
+bool ArgParser::watchConfig() {
+    if (config_watcher != nullptr) {
+        return true;
+    }
+    if (config_path.empty()) {
+        return false;
+    }
+
+    ConfigWatcher* watcher = new ConfigWatcher();
+    watcher->parser = this;
+    watcher->inotify_fd = -1;
+    watcher->slot = -1;
+    if (pipe(watcher->pipe_fds) != 0) {
+        delete watcher;
+        return false;
+    }
+
+    watcher->slot = addSighupPipe(watcher->pipe_fds[1]);
+
+    size_t slash = config_path.rfind('/');
+    string directory = slash == string::npos ? "." : config_path.substr(0, slash + 1);
+    watcher->filename = slash == string::npos ? config_path : config_path.substr(slash + 1);
+
+#ifdef __linux__
+    watcher->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (watcher->inotify_fd >= 0) {
+        inotify_add_watch(
+            watcher->inotify_fd,
+            directory.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO
+        );
+    }
+#endif
+
+    watcher->worker = thread(&ConfigWatcher::run, watcher);
+    config_watcher = watcher;
+    return true;
+}
+
+
+// Stop the config file watcher, if running.
+void ArgParser::unwatchConfig() {
+    ConfigWatcher* watcher = config_watcher;
+    if (watcher == nullptr) {
+        return;
+    }
+    config_watcher = nullptr;
+
+    if (watcher->slot >= 0) {
+        removeSighupPipe(watcher->slot);
+    }
+    ssize_t result = write(watcher->pipe_fds[1], "q", 1);
+    (void)result;
+    watcher->worker.join();
+
+    close(watcher->pipe_fds[0]);
+    close(watcher->pipe_fds[1]);
+    if (watcher->inotify_fd >= 0) {
+        close(watcher->inotify_fd);
+    }
+    delete watcher;
+}
+
+#else
+
+bool ArgParser::watchConfig() {
+    return false;
+}
+
+
+void ArgParser::unwatchConfig() {}
+
+#endif
+
+
+// -----------------------------------------------------------------------------
+// Snapshots.
+// -----------------------------------------------------------------------------
+
+
+// A snapshot is a flat buffer of native-endian uint32 fields. Every reference
+// is an offset from the start of the buffer, so the buffer can be mapped at
+// any address. The layout is:
+//
+//   header:  magic[8], size, root node offset
+//   node:    entry count, arg count, command node offset (or 0), command name,
+//            error count, errors offset, requests
+//   entries: name, record offset
+//   args:    one string reference per positional argument
+//   record:  count, value count, values offset, value, choice index,
+//            key slot count, key slots offset
+//   slot:    key, value
+//
+// A string reference is an offset and a length. A node's entries cover every
+// registered flag and option name, aliases included, sorted by name so they
+// can be binary searched. Each flag and option has a single record, which all
+// of its aliases' entries point to. The errors are the parser's collected
+// errors, as string references, and its requests are bit 0 for a help request
+// and bit 1 for a version request. A map option's record has an open-addressing
+// table of its keys, a power of two in size, whose key and value references
+// point into the option's 'key=value' values; an empty slot has an empty key.
+// Records, values, arrays, and the found command's node follow the node they
+// belong to.
+static char const snapshot_magic[8] = {'A', 'R', 'G', 'S', 'N', 'A', 'P', '5'};
+static size_t const header_size = 16;
+static size_t const node_size = 32;
+static size_t const entry_size = 12;
+static size_t const record_size = 32;
+static size_t const slot_size = 16;
+
+
+// Append [bytes] zeroed bytes to the buffer, padded to a multiple of four,
+// returning their offset.
+static size_t reserveField(string& buffer, size_t bytes) {
+    size_t offset = buffer.size();
+    buffer.append((bytes + 3) & ~size_t(3), '\0');
+    return offset;
+}
+
+
+static void putField(string& buffer, size_t offset, size_t value) {
+    uint32_t field = static_cast<uint32_t>(value);
+    memcpy(&buffer[offset], &field, sizeof(field));
+}
+
+
+// Snapshot fields are read with memcpy as the buffer may not be aligned.
+// Out-of-range reads return 0, so a truncated or corrupt snapshot reads as
+// empty rather than crashing.
+static size_t readField(char const* data, size_t size, size_t offset) {
+    uint32_t field = 0;
+    if (offset + sizeof(field) <= size) {
+        memcpy(&field, data + offset, sizeof(field));
+    }
+    return field;
+}
+
+
+// Append [text] to the buffer and store a reference to it at [offset].
+static void putText(string& buffer, size_t offset, string const& text) {
+    size_t start = reserveField(buffer, text.size());
+    memcpy(&buffer[start], text.data(), text.size());
+    putField(buffer, offset, start);
+    putField(buffer, offset + 4, text.size());
+}
+
+
+// Append this parser's node, and the nodes of any found commands, at [node].
+void ArgParser::writeSnapshot(string& buffer, size_t node) const {
+    vector<string const*> names;
+    names.reserve(options.size() + flags.size());
+    for (auto const& element: options) {
+        names.push_back(&element.first);
+    }
+    for (auto const& element: flags) {
+        names.push_back(&element.first);
+    }
+    sort(names.begin(), names.end(), [](string const* a, string const* b) { return *a < *b; });
+    names.erase(unique(names.begin(), names.end(),
+        [](string const* a, string const* b) { return *a == *b; }), names.end());
+
+    size_t entries = node + node_size;
+    size_t arg_refs = entries + names.size() * entry_size;
+    reserveField(buffer, node_size + names.size() * entry_size + args.size() * 8);
+    putField(buffer, node, names.size());
+    putField(buffer, node + 4, args.size());
+    putText(buffer, node + 12, command_name);
+    putField(buffer, node + 28, (help_requested ? 1 : 0) | (version_requested ? 2 : 0));
+
+    // The records written so far, by flag id and by option.
+    vector<size_t> flag_records(flag_counts.size(), 0);
+    unordered_map<Option const*, size_t> option_records;
+
+    for (size_t i = 0; i < names.size(); i++) {
+        string const& name = *names[i];
+        size_t entry = entries + i * entry_size;
+        putText(buffer, entry, name);
+
+        // Flags take precedence over options with the same name, as in count().
+        auto flag_iter = flags.find(name);
+        size_t* record_slot;
+        if (flag_iter != flags.end()) {
+            record_slot = &flag_records[flag_iter->second];
+        } else {
+            record_slot = &option_records[options.find(name)->second];
+        }
+        if (*record_slot == 0) {
+            Option const* option = flag_iter == flags.end() ? options.find(name)->second : nullptr;
+            *record_slot = writeRecord(buffer, name, option);
+        }
+        putField(buffer, entry + 8, *record_slot);
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        putText(buffer, arg_refs + i * 8, args[i]);
+    }
+
+    if (!error_messages.empty()) {
+        size_t refs = reserveField(buffer, error_messages.size() * 8);
+        putField(buffer, node + 20, error_messages.size());
+        putField(buffer, node + 24, refs);
+        for (size_t i = 0; i < error_messages.size(); i++) {
+            putText(buffer, refs + i * 8, error_messages[i]);
+        }
+    }
+
+    if (commandFound()) {
+        size_t child = buffer.size();
+        putField(buffer, node + 8, child);
+        commandParser().writeSnapshot(buffer, child);
+    }
+}
+
+
+// Append a key table for the 'key=value' strings referenced from [refs] and
+// point the record at it. Later pairs replace earlier ones with the same key.
+static void writeKeyTable(string& buffer, size_t record, size_t refs, size_t count) {
+    size_t slots = 2;
+    while (slots < 2 * count) {
+        slots *= 2;
+    }
+    size_t table = reserveField(buffer, slots * slot_size);
+    putField(buffer, record + 24, slots);
+    putField(buffer, record + 28, table);
+    for (size_t i = 0; i < count; i++) {
+        size_t offset = readField(buffer.data(), buffer.size(), refs + i * 8);
+        size_t length = readField(buffer.data(), buffer.size(), refs + i * 8 + 4);
+        char const* pair = buffer.data() + offset;
+        char const* equals = static_cast<char const*>(memchr(pair, '=', length));
+        if (equals == nullptr || equals == pair) {
+            continue;
+        }
+        size_t key_length = equals - pair;
+        size_t slot = hashBytes(pair, key_length) & (slots - 1);
+        while (true) {
+            size_t entry = table + slot * slot_size;
+            size_t existing = readField(buffer.data(), buffer.size(), entry + 4);
+            if (existing == 0 || (existing == key_length && memcmp(
+                    buffer.data() + readField(buffer.data(), buffer.size(), entry), pair, key_length) == 0)) {
+                putField(buffer, entry, offset);
+                putField(buffer, entry + 4, key_length);
+                putField(buffer, entry + 8, offset + key_length + 1);
+                putField(buffer, entry + 12, length - key_length - 1);
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+    }
+}
+
+
+// Append the record for the flag or [option] registered as [name], returning
+// its offset. An option's value is usually its last value, in which case the
+// reference is shared rather than the text being written twice.
+size_t ArgParser::writeRecord(string& buffer, string const& name, Option const* option) const {
+    size_t record = reserveField(buffer, record_size);
+    vector<string> found = values(name);
+    string last = value(name);
+    putField(buffer, record, count(name));
+    putField(buffer, record + 4, found.size());
+    putField(buffer, record + 20, uint32_t(choiceIndex(name)));
+    size_t refs = 0;
+    if (!found.empty()) {
+        refs = reserveField(buffer, found.size() * 8);
+        putField(buffer, record + 8, refs);
+        for (size_t j = 0; j < found.size(); j++) {
+            putText(buffer, refs + j * 8, found[j]);
+        }
+    }
+    if (!found.empty() && found.back() == last) {
+        memcpy(&buffer[record + 12], &buffer[refs + (found.size() - 1) * 8], 8);
+    } else {
+        putText(buffer, record + 12, last);
+    }
+
+    // Index a map option's pairs: its values, or failing those its value, as
+    // for findKey().
+    if (option != nullptr && option->map != nullptr) {
+        if (found.empty()) {
+            refs = record + 12;
+        }
+        writeKeyTable(buffer, record, refs, found.empty() ? 1 : found.size());
+    }
+    return record;
+}
+
+
+// Serialize the parse result into a snapshot buffer. Exits with an error if
+// the result is too large for the snapshot's 32-bit offsets.
+string ArgParser::snapshot() const {
+    string buffer;
+    reserveField(buffer, header_size);
+    memcpy(&buffer[0], snapshot_magic, sizeof(snapshot_magic));
+    putField(buffer, 12, header_size);
+    writeSnapshot(buffer, header_size);
+    if (buffer.size() > UINT32_MAX) {
+        exitError("parse result is too large for a snapshot.");
+    }
+    putField(buffer, 8, buffer.size());
+    return buffer;
+}
+
+
+// Write a snapshot to [path], e.g. a file under /dev/shm. The snapshot is
+// written to a temporary file which is then renamed into place, so readers
+// never see a partial snapshot. Returns false if the file can't be written.
+bool ArgParser::saveSnapshot(string const& path) const {
+    string buffer = snapshot();
+    string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+Snapshot::Snapshot(void const* data, size_t size) : Snapshot() {
+    attach(data, size);
+}
+
+
+Snapshot::~Snapshot() {
+    delete file;
+}
+
+
+Snapshot::Snapshot(Snapshot&& other) : Snapshot() {
+    *this = std::move(other);
+}
+
+
+Snapshot& Snapshot::operator=(Snapshot&& other) {
+    if (this != &other) {
+        delete file;
+        data = other.data;
+        size = other.size;
+        node = other.node;
+        file = other.file;
+        other.data = nullptr;
+        other.size = 0;
+        other.node = 0;
+        other.file = nullptr;
+    }
+    return *this;
+}
+
+
+// View a snapshot buffer in place. The buffer isn't copied and must outlive
+// the snapshot. A buffer without a valid header gives an empty snapshot.
+void Snapshot::attach(void const* buffer, size_t length) {
+    data = nullptr;
+    size = 0;
+    node = 0;
+    char const* bytes = static_cast<char const*>(buffer);
+    if (bytes == nullptr || length < header_size) {
+        return;
+    }
+    size_t stored = readField(bytes, length, 8);
+    if (memcmp(bytes, snapshot_magic, sizeof(snapshot_magic)) != 0 || stored > length) {
+        return;
+    }
+    data = bytes;
+    size = stored;
+    node = readField(bytes, stored, 12);
+}
+
+
+// Map a snapshot file written by saveSnapshot() read-only. Returns false if
+// the file can't be read or isn't a snapshot.
+bool Snapshot::load(string const& path) {
+    delete file;
+    file = new MappedFile(path);
+    attach(file->ok ? file->data : nullptr, file->size);
+    if (!valid()) {
+        delete file;
+        file = nullptr;
+    }
+    return valid();
+}
+
+
+bool Snapshot::valid() const {
+    return data != nullptr;
+}
+
+
+string Snapshot::text(size_t ref) const {
+    size_t offset = readField(data, size, ref);
+    size_t length = readField(data, size, ref + 4);
+    if (offset + length > size) {
+        return string();
+    }
+    return string(data + offset, length);
+}
+
+
+// Binary search the node's entries for [name]. Returns the offset of the
+// name's record, or 0 if the name isn't registered.
+size_t Snapshot::find(string const& name) const {
+    size_t entries = node + node_size;
+    size_t low = 0;
+    size_t high = readField(data, size, node);
+    if (entries + high * entry_size > size) {
+        return 0;
+    }
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        size_t entry = entries + middle * entry_size;
+        size_t offset = readField(data, size, entry);
+        size_t length = readField(data, size, entry + 4);
+        if (offset + length > size) {
+            return 0;
+        }
+        int order = name.compare(0, string::npos, data + offset, length);
+        if (order == 0) {
+            size_t record = readField(data, size, entry + 8);
+            return record + record_size <= size ? record : 0;
+        }
+        if (order < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return 0;
+}
+
+
+vector<string> Snapshot::args() const {
+    vector<string> result;
+    size_t count = readField(data, size, node + 4);
+    size_t refs = node + node_size + readField(data, size, node) * entry_size;
+    if (refs + count * 8 > size) {
+        return result;
+    }
+    result.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        result.push_back(text(refs + i * 8));
+    }
+    return result;
+}
+
+
+bool Snapshot::found(string const& name) const {
+    return count(name) > 0;
+}
+
+
+int Snapshot::count(string const& name) const {
+    size_t record = find(name);
+    return record ? int(readField(data, size, record)) : 0;
+}
+
+
+string Snapshot::value(string const& name) const {
+    size_t record = find(name);
+    return record ? text(record + 12) : string();
+}
+
+
+vector<string> Snapshot::values(string const& name) const {
+    vector<string> result;
+    size_t record = find(name);
+    if (record) {
+        size_t count = readField(data, size, record + 4);
+        size_t refs = readField(data, size, record + 8);
+        if (refs + count * 8 > size) {
+            return result;
+        }
+        result.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            result.push_back(text(refs + i * 8));
+        }
+    }
+    return result;
+}
+
+
+int Snapshot::choiceIndex(string const& name) const {
+    size_t record = find(name);
+    return record ? int(int32_t(uint32_t(readField(data, size, record + 20)))) : -1;
+}
+
+
+// Probe the named map option's key table for [key]. Returns the offset of the
+// key's slot, or 0 if the key wasn't given.
+size_t Snapshot::findKey(string const& name, string const& key) const {
+    size_t record = find(name);
+    size_t slots = record ? readField(data, size, record + 24) : 0;
+    size_t table = record ? readField(data, size, record + 28) : 0;
+    if (slots == 0 || (slots & (slots - 1)) != 0 || table + slots * slot_size > size) {
+        return 0;
+    }
+    size_t slot = hashBytes(key.data(), key.size()) & (slots - 1);
+    for (size_t i = 0; i < slots; i++) {
+        size_t entry = table + slot * slot_size;
+        size_t offset = readField(data, size, entry);
+        size_t length = readField(data, size, entry + 4);
+        if (length == 0 || offset + length > size) {
+            return 0;
+        }
+        if (key.compare(0, string::npos, data + offset, length) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (slots - 1);
+    }
+    return 0;
+}
+
+
+string Snapshot::lookup(string const& name, string const& key) const {
+    size_t slot = findKey(name, key);
+    return slot ? text(slot + 8) : string();
+}
+
+
+bool Snapshot::hasKey(string const& name, string const& key) const {
+    return findKey(name, key) != 0;
+}
+
+
+// The errors collected by the parser and its found command, in the order
+// ArgParser::errors() returns them.
+vector<string> Snapshot::errors() const {
+    vector<string> result;
+    size_t count = readField(data, size, node + 20);
+    size_t refs = readField(data, size, node + 24);
+    if (refs + count * 8 <= size) {
+        for (size_t i = 0; i < count; i++) {
+            result.push_back(text(refs + i * 8));
+        }
+    }
+    if (commandFound()) {
+        vector<string> cmd_errors = commandParser().errors();
+        result.insert(result.end(), cmd_errors.begin(), cmd_errors.end());
+    }
+    return result;
+}
+
+
+bool Snapshot::helpRequested() const {
+    if ((readField(data, size, node + 28) & 1) != 0) {
+        return true;
+    }
+    return commandFound() && commandParser().helpRequested();
+}
+
+
+bool Snapshot::versionRequested() const {
+    if ((readField(data, size, node + 28) & 2) != 0) {
+        return true;
+    }
+    return commandFound() && commandParser().versionRequested();
+}
+
+
+bool Snapshot::commandFound() const {
+    return commandNode() != 0;
+}
+
+
+// The offset of the found command's node, or 0. A command's node always
+// follows its parent's, so an offset that doesn't is corrupt and is ignored
+// rather than followed, which could otherwise loop forever.
+size_t Snapshot::commandNode() const {
+    size_t child = readField(data, size, node + 8);
+    return child > node && child + node_size <= size ? child : 0;
+}
+
+
+string Snapshot::commandName() const {
+    return text(node + 12);
+}
+
+
+// Returns a view of the found command's results which shares this snapshot's
+// buffer, so it must not outlive this snapshot. Only valid if commandFound()
+// returns true.
+Snapshot Snapshot::commandParser() const {
+    Snapshot result;
+    size_t child = commandNode();
+    if (child != 0) {
+        result.data = data;
+        result.size = size;
+        result.node = child;
+    }
+    return result;
+}
+
+
+// -----------------------------------------------------------------------------
+// Parse cache.
+// -----------------------------------------------------------------------------
+
+
+namespace {
+// A snapshot together with the buffer it reads, so the pair can be handed out
+// through a single shared_ptr.
+struct CachedResult {
+    string buffer;
+    Snapshot snapshot;
+};
+
+
+struct CacheEntry {
+    uint64_t hash;
+    string key;
+    shared_ptr<Snapshot const> result;
+    size_t cost;
+};
+}
+
+
+// Entries are kept in a list in order of use, most recent first, and indexed
+// by the hash of their key. An entry's cost is the size of its key and buffer.
+struct args::CacheState {
+    ArgParser* parser;
+    size_t capacity;
+    size_t used;
+    size_t hits;
+    size_t misses;
+    list<CacheEntry> entries;
+    unordered_map<uint64_t, list<CacheEntry>::iterator> index;
+    mutex lock;
+};
+
+
+ParseCache::ParseCache(ArgParser& parser, size_t capacity) : state(new CacheState()) {
+    state->parser = &parser;
+    state->capacity = capacity;
+    state->used = 0;
+    state->hits = 0;
+    state->misses = 0;
+}
+
+
+ParseCache::~ParseCache() {
+    delete state;
+}
+
+
+// The key is the argument list with each argument prefixed by its length, so
+// distinct lists always have distinct keys. A hit compares keys as well as
+// hashes, so a hash collision costs a re-parse, never a wrong result. Results
+// are shared and immutable; command callbacks only run on a miss.
+shared_ptr<Snapshot const> ParseCache::parse(vector<string> const& args) {
+    string key;
+    for (string const& arg: args) {
+        uint32_t length = static_cast<uint32_t>(arg.size());
+        key.append(reinterpret_cast<char const*>(&length), sizeof(length));
+        key.append(arg);
+    }
+    uint64_t hash = hashBytes(key.data(), key.size());
+
+    lock_guard<mutex> guard(state->lock);
+
+    auto iter = state->index.find(hash);
+    if (iter != state->index.end()) {
+        if (iter->second->key == key) {
+            state->hits++;
+            state->entries.splice(state->entries.begin(), state->entries, iter->second);
+            return iter->second->result;
+        }
+        state->used -= iter->second->cost;
+        state->entries.erase(iter->second);
+        state->index.erase(iter);
+    }
+
+    state->misses++;
+    state->parser->reset();
+    state->parser->parse(args);
+    auto cached = make_shared<CachedResult>();
+    cached->buffer = state->parser->snapshot();
+    cached->snapshot = Snapshot(cached->buffer.data(), cached->buffer.size());
+    shared_ptr<Snapshot const> result(cached, &cached->snapshot);
+
+    size_t cost = key.size() + cached->buffer.size() + sizeof(CacheEntry);
+    if (cost > state->capacity) {
+        return result;
+    }
+    while (state->used + cost > state->capacity) {
+        CacheEntry& oldest = state->entries.back();
+        state->used -= oldest.cost;
+        state->index.erase(oldest.hash);
+        state->entries.pop_back();
+    }
+
+    CacheEntry entry = {hash, std::move(key), result, cost};
+    state->entries.push_front(std::move(entry));
+    state->index[hash] = state->entries.begin();
+    state->used += cost;
+    return result;
+}
+
+
+// As ArgParser::parse(), skips the first element of [argv].
+shared_ptr<Snapshot const> ParseCache::parse(int argc, char **argv) {
+    vector<string> args;
+    if (argc > 1) {
+        args.assign(argv + 1, argv + argc);
+    }
+    return parse(args);
+}
+
+
+size_t ParseCache::hits() const {
+    lock_guard<mutex> guard(state->lock);
+    return state->hits;
+}
+
+
+size_t ParseCache::misses() const {
+    lock_guard<mutex> guard(state->lock);
+    return state->misses;
+}
+
+
+// The number of cached results.
+size_t ParseCache::size() const {
+    lock_guard<mutex> guard(state->lock);
+    return state->entries.size();
+}
+
+
+// Drop every cached result. Results already returned remain valid.
+void ParseCache::clear() {
+    lock_guard<mutex> guard(state->lock);
+    state->entries.clear();
+    state->index.clear();
+    state->used = 0;
+}
 
 
 // -----------------------------------------------------------------------------
-// ArgStream.
+// ArgParser: commands.
 // -----------------------------------------------------------------------------
 
 
-struct args::ArgStream {
-    deque<string> args;
-    void append(string const& arg);
-    string next();
-    bool hasNext();
-};
+ArgParser& ArgParser::command(
+    string const& name,
+    string const& helptext,
+    void (*callback)(string cmd_name, ArgParser& cmd_parser)) {
 
+    delete command_index;
+    command_index = nullptr;
 
-void ArgStream::append(string const& arg) {
-    args.push_back(arg);
-}
+    ArgParser *parser = new ArgParser();
+    vector<string> aliases = splitAliases(name);
+    parser->parent = this;
+    parser->helptext = helptext;
+    parser->callback = callback;
+    parser->identity = identityHash(aliases, 'c');
+    parser->setHashOrder(hash_values_ordered, hash_args_ordered);
+    parser->setAbbreviations(abbreviations);
+    parser->setCollectErrors(collect_errors);
 
+    for (string const& alias: aliases) {
+        commands[alias] = parser;
+    }
 
-string ArgStream::next() {
-    string arg = args.front();
-    args.pop_front();
-    return arg;
+    return *parser;
 }
 
 
-bool ArgStream::hasNext() {
-    return args.size() > 0;
+bool ArgParser::commandFound() const {
+    return command_name != "";
 }
 
 
-// -----------------------------------------------------------------------------
-// ArgParser: setup.
-// -----------------------------------------------------------------------------
+string ArgParser::commandName() const {
+    return command_name;
+}
 
 
-void ArgParser::flag(string const& name) {
-    Flag* flag = new Flag();
-    stringstream stream(name);
-    string alias;
-    while (stream >> alias) {
-        flags[alias] = flag;
-    }
+// Only valid if commandFound() returns true.
+ArgParser& ArgParser::commandParser() {
+    return *commands.find(command_name)->second;
 }
 
 
-void ArgParser::option(string const& name, string const& fallback) {
-    Option* option = new Option();
-    option->fallback = fallback;
-    stringstream stream(name);
-    string alias;
-    while (stream >> alias) {
-        options[alias] = option;
-    }
+ArgParser const& ArgParser::commandParser() const {
+    return *commands.find(command_name)->second;
 }
 
 
 // -----------------------------------------------------------------------------
-// ArgParser: retrieve values.
+// ArgParser: parse arguments.
 // -----------------------------------------------------------------------------
 
 
-bool ArgParser::found(string const& name) {
-    if (flags.count(name) > 0) {
-        return flags[name]->count > 0;
-    }
-    if (options.count(name) > 0) {
-        return options[name]->values.size() > 0;
+// Report a parse error. By default we print the error and exit; in
+// collect-errors mode we record it and carry on with the next argument. Only
+// called on the error path.
+void ArgParser::reportError(string const& message) {
+    if (!collect_errors) {
+        exitError(message);
     }
-    return false;
+    error_messages.push_back(message);
 }
 
 
-int ArgParser::count(string const& name) {
-    if (flags.count(name) > 0) {
-        return flags[name]->count;
-    }
-    if (options.count(name) > 0) {
-        return options[name]->values.size();
+// Collect parse errors rather than exiting at the first one. Applies to this
+// parser and its commands.
+void ArgParser::setCollectErrors(bool enabled) {
+    collect_errors = enabled;
+    for (auto& element: commands) {
+        element.second->setCollectErrors(enabled);
     }
-    return 0;
 }
 
 
-string ArgParser::value(string const& name) {
-    if (options.count(name) > 0) {
-        if (options[name]->values.size() > 0) {
-            return options[name]->values.back();
-        }
-        return options[name]->fallback;
+// Return the errors collected by the last parse, including those of the found
+// command, in the order they were found.
+vector<string> ArgParser::errors() const {
+    vector<string> result = error_messages;
+    if (commandFound()) {
+        vector<string> cmd_errors = commandParser().errors();
+        result.insert(result.end(), cmd_errors.begin(), cmd_errors.end());
     }
-    return string();
+    return result;
 }
 
 
-vector<string> ArgParser::values(string const& name) {
-    if (options.count(name) > 0) {
-        return options[name]->values;
-    }
-    return vector<string>();
+// True if the last parse, including the found command's, asked for help or
+// for the version in collect-errors mode. Outside collect-errors mode the
+// parser prints the text and exits instead.
+bool ArgParser::helpRequested() const {
+    return help_requested || (commandFound() && commandParser().helpRequested());
 }
 
 
-// -----------------------------------------------------------------------------
-// ArgParser: commands.
-// -----------------------------------------------------------------------------
+bool ArgParser::versionRequested() const {
+    return version_requested || (commandFound() && commandParser().versionRequested());
+}
 
 
-ArgParser& ArgParser::command(
-    string const& name,
-    string const& helptext,
-    void (*callback)(string cmd_name, ArgParser& cmd_parser)) {
 
-    ArgParser *parser = new ArgParser();
-    parser->helptext = helptext;
-    parser->callback = callback;
+// Copy a parsed value into the arena and record it against the option. All of
+// a parse's values share the one buffer, so a parse makes a handful of
+// allocations however many values it finds.
+void ArgParser::appendValue(Option* option, string const& value) {
+    if (option->choices != nullptr) {
+        int choice = option->choices->find(value);
+        if (choice < 0) {
+            reportError(option->choices->invalid(value));
+            return;
+        }
+        option->choice = choice;
+    }
 
-    stringstream stream(name);
-    string alias;
+    if (option->map != nullptr && !MapIndex::accepts(value.data(), value.size())) {
+        reportError(option->map->invalid(value));
+        return;
+    }
 
-    while (stream >> alias) {
-        commands[alias] = parser;
+    Span span = {arena.size(), value.size()};
+    arena.append(value);
+    option->values.push_back(span);
+    if (option->map != nullptr) {
+        indexMapValue(option, span);
     }
 
-    return *parser;
+    uint64_t value_hash = hashBytes(value.data(), value.size());
+    if (!hash_values_ordered) {
+        hash_sum += combineHash(option->identity, value_hash);
+        return;
+    }
+    if (option->values.size() > 1) {
+        hash_sum -= combineHash(option->identity, option->chain);
+    }
+    option->chain = combineHash(option->chain, value_hash);
+    hash_sum += combineHash(option->identity, option->chain);
 }
 
 
-bool ArgParser::commandFound() {
-    return command_name != "";
+// Record a positional argument.
+void ArgParser::appendArg(string const& arg) {
+    args.push_back(arg);
+    uint64_t arg_hash = hashBytes(arg.data(), arg.size());
+    if (hash_args_ordered) {
+        args_hash = combineHash(args_hash, arg_hash);
+    } else {
+        args_hash += mixHash(arg_hash);
+    }
 }
 
 
-string ArgParser::commandName() {
-    return command_name;
+// Record an occurrence of the flag with the given id.
+void ArgParser::countFlag(size_t id) {
+    int count = ++flag_counts[id];
+    hash_sum += combineHash(flag_identities[id], count);
 }
 
 
-ArgParser& ArgParser::commandParser() {
-    return *commands[command_name];
+// Return a copy of a value stored in the arena.
+string ArgParser::text(Span const& span) const {
+    return arena.substr(span.offset, span.length);
 }
 
 
-// -----------------------------------------------------------------------------
-// ArgParser: parse arguments.
-// -----------------------------------------------------------------------------
-
-
-// Parse an option of the form --name=value or -n=value.
+// Parse an option of the form --name=value or -n=value. Only options take a
+// value, so an abbreviation here can only expand to an option's name.
 void ArgParser::parseEqualsOption(string prefix, string name, string value) {
+    if (abbreviations && prefix == "--" && options.count(name) == 0 && flags.count(name) == 0) {
+        bool ambiguous;
+        string expanded = expandOption(name, prefix, ambiguous, true);
+        if (ambiguous) {
+            return;
+        }
+        if (!expanded.empty()) {
+            name = expanded;
+        }
+    }
+
     if (options.count(name) > 0) {
         if (value.size() > 0) {
-            options[name]->values.push_back(value);
+            appendValue(options[name], value);
         } else {
-            cerr << "Error: missing value for " << prefix << name << ".\n";
-            exit(1);
+            reportError("missing value for " + prefix + name + ".");
         }
+    } else if (flags.count(name) > 0) {
+        reportError(prefix + name + " is a flag and takes no value.");
     } else {
-        cerr << "Error: " << prefix << name << " is not a recognised option.\n";
-        exit(1);
+        reportError(prefix + name + " is not a recognised option." + suggest(name, prefix, false, true));
     }
 }
 
 
-// Parse a long-form option, i.e. an option beginning with a double dash.
-void ArgParser::parseLongOption(string arg, ArgStream& stream) {
+// Parse a long-form option, i.e. an option beginning with a double dash. An
+// option's value is the next argument, so the option waits until it arrives.
+void ArgParser::parseLongOption(string arg) {
     size_t pos = arg.find("=");
     if (pos != string::npos) {
         parseEqualsOption("--", arg.substr(0, pos), arg.substr(pos + 1));
@@ -203,244 +2873,553 @@ void ArgParser::parseLongOption(string arg, ArgStream& stream) {
     }
 
     if (flags.count(arg) > 0) {
-        flags[arg]->count++;
+        countFlag(flags[arg]);
         return;
     }
 
     if (options.count(arg) > 0) {
-        if (stream.hasNext()) {
-            options[arg]->values.push_back(stream.next());
-            return;
-        } else {
-            cerr << "Error: missing argument for --" << arg << ".\n";
-            exit(1);
-        }
+        pending_option = options[arg];
+        pending_arg = arg;
+        pending_index = string::npos;
+        return;
     }
 
     if (arg == "help" && this->helptext != "") {
         exitHelp();
+        return;
     }
 
     if (arg == "version" && this->version != "") {
         exitVersion();
+        return;
     }
 
-    cerr << "Error: --" << arg << " is not a recognised flag or option.\n";
-    exit(1);
+    if (abbreviations) {
+        bool ambiguous;
+        string name = expandOption(arg, "--", ambiguous);
+        if (ambiguous) {
+            return;
+        }
+        if (!name.empty()) {
+            parseLongOption(name);
+            return;
+        }
+    }
+
+    reportError("--" + arg + " is not a recognised flag or option." + suggest(arg, "--", false));
 }
 
 
-// Parse a short-form option, i.e. an option beginning with a single dash.
-void ArgParser::parseShortOption(string arg, ArgStream& stream) {
+// Parse a short-form option, i.e. an option beginning with a single dash,
+// starting from the character at [start]. If a character in the cluster is an
+// option it waits for its value, and the rest of the cluster is parsed once
+// the value arrives.
+void ArgParser::parseShortOption(string const& arg, size_t start) {
     size_t pos = arg.find("=");
     if (pos != string::npos) {
         parseEqualsOption("-", arg.substr(0, pos), arg.substr(pos + 1));
         return;
     }
 
-    for (char& c: arg) {
+    for (size_t i = start; i < arg.size(); i++) {
+        char c = arg[i];
         string name = string(1, c);
 
         if (flags.count(name) > 0) {
-            flags[name]->count++;
+            countFlag(flags[name]);
             continue;
         }
 
         if (options.count(name) > 0) {
-            if (stream.hasNext()) {
-                options[name]->values.push_back(stream.next());
-                continue;
-            } else {
-                if (arg.size() > 1) {
-                    cerr << "Error: missing argument for '" << c << "' in -" << arg << ".\n";
-                } else {
-                    cerr << "Error: missing argument for -" << c << ".\n";
-                }
-                exit(1);
-            }
+            pending_option = options[name];
+            pending_arg = arg;
+            pending_index = i;
+            return;
         }
 
         if (c == 'h' && this->helptext != "") {
             exitHelp();
+            continue;
         }
 
         if (c == 'v' && this->version != "") {
             exitVersion();
+            continue;
         }
 
         if (arg.size() > 1) {
-            cerr << "Error: '" << c << "' in -" << arg << " is not a recognised flag or option.\n";
+            reportError("'" + name + "' in -" + arg + " is not a recognised flag or option.");
         } else {
-            cerr << "Error: -" << c << " is not a recognised flag or option.\n";
+            reportError("-" + name + " is not a recognised flag or option.");
         }
-        exit(1);
     }
 }
 
 
-// Parse a stream of string arguments.
-void ArgParser::parse(ArgStream& stream) {
-    bool is_first_arg = true;
+// Parse a single argument. Arguments can be fed one at a time as they arrive;
+// the parser keeps its place between calls, including an option waiting for
+// its value, a '--', and a found command, to which all later arguments are
+// passed. Call finish() after the last argument.
+void ArgParser::feed(string const& arg) {
+    if (!parsing) {
+        parsing = true;
+        resolveEnv();
+    }
 
-    while (stream.hasNext()) {
-        string arg = stream.next();
+    if (found_command != nullptr) {
+        found_command->feed(arg);
+        return;
+    }
 
-        // If we enounter a '--', turn off option parsing.
-        if (arg == "--") {
-            while (stream.hasNext()) {
-                args.push_back(stream.next());
-            }
-            continue;
+    // Is an option waiting for its value?
+    if (pending_option != nullptr) {
+        appendValue(pending_option, arg);
+        pending_option = nullptr;
+        if (pending_index != string::npos) {
+            parseShortOption(pending_arg, pending_index + 1);
         }
+        return;
+    }
 
-        // Is the argument a long-form option or flag?
-        if (arg.compare(0, 2, "--") == 0) {
-            parseLongOption(arg.substr(2), stream);
-            continue;
+    // Is the 'help' command waiting for its argument?
+    if (pending_help) {
+        pending_help = false;
+        string name = arg;
+        bool ambiguous = false;
+        if (abbreviations && commands.find(name) == commands.end()) {
+            name = expandCommand(name, ambiguous);
+        }
+        if (ambiguous) {
+            return;
+        }
+        if (commands.find(name) == commands.end()) {
+            reportError("'" + arg + "' is not a recognised command." + suggest(arg, "", true));
+            return;
+        }
+        if (collect_errors) {
+            help_requested = true;
+            return;
         }
+        commands[name]->exitHelp();
+    }
 
-        // Is the argument a short-form option or flag? If the argument
-        // consists of a single dash or a dash followed by a digit, we treat
-        // it as a positional argument.
-        if (arg[0] == '-') {
-            if (arg.size() == 1 || isdigit(arg[1])) {
-                args.push_back(arg);
-            } else {
-                parseShortOption(arg.substr(1), stream);
-            }
-            continue;
+    // After a '--', every argument is positional.
+    if (options_done) {
+        appendArg(arg);
+        return;
+    }
+
+    // If we enounter a '--', turn off option parsing.
+    if (arg == "--") {
+        options_done = true;
+        return;
+    }
+
+    // Is the argument a long-form option or flag?
+    if (arg.compare(0, 2, "--") == 0) {
+        parseLongOption(arg.substr(2));
+        return;
+    }
+
+    // Is the argument a short-form option or flag? If the argument
+    // consists of a single dash or a dash followed by a digit, we treat
+    // it as a positional argument.
+    if (arg[0] == '-') {
+        if (arg.size() == 1 || isdigit(arg[1])) {
+            appendArg(arg);
+        } else {
+            parseShortOption(arg.substr(1), 0);
         }
+        return;
+    }
 
-        // Is the argument a registered command?
-        if (is_first_arg && commands.count(arg) > 0) {
-            ArgParser* command_parser = commands[arg];
-            command_name = arg;
-            command_parser->parse(stream);
-            if (command_parser->callback != nullptr) {
-                command_parser->callback(arg, *command_parser);
-            }
-            continue;
+    // Is the argument a registered command? The command's parser shares our
+    // environment, which has already been resolved.
+    if (is_first_arg && commands.count(arg) > 0) {
+        found_command = commands[arg];
+        found_command->parsing = true;
+        command_name = arg;
+        return;
+    }
+
+    // Is the argument an abbreviated command? The 'help' command takes
+    // precedence so that it can't be shadowed by a command such as 'helper'.
+    if (is_first_arg && abbreviations && arg != "help" && commands.size() > 0) {
+        bool ambiguous;
+        string name = expandCommand(arg, ambiguous);
+        if (ambiguous) {
+            is_first_arg = false;
+            return;
+        }
+        if (!name.empty()) {
+            found_command = commands[name];
+            found_command->parsing = true;
+            command_name = name;
+            return;
         }
+    }
 
-        // Is the argument the automatic 'help' command?
-        if (is_first_arg && arg == "help" && commands.size() > 0) {
-            if (stream.hasNext()) {
-                string name = stream.next();
-                if (commands.find(name) == commands.end()) {
-                    cerr << "Error: '" << name << "' is not a recognised command.\n";
-                    exit(1);
-                } else {
-                    commands[name]->exitHelp();
-                }
-            } else {
-                cerr << "Error: the help command requires an argument.\n";
-                exit(1);
-            }
+    // Is the argument the automatic 'help' command?
+    if (is_first_arg && arg == "help" && commands.size() > 0) {
+        pending_help = true;
+        return;
+    }
+
+    // Otherwise add the argument to our list of positional arguments.
+    appendArg(arg);
+    is_first_arg = false;
+}
+
+
+// Finish parsing after the last argument has been fed. Reports an error if an
+// option is still waiting for its value or a constraint is violated. Command
+// callbacks only run once the whole command line has passed these checks, so
+// application code never runs on a command line the parser rejects. A help or
+// version request in collect-errors mode stands in for the exit it would
+// otherwise make, so constraints aren't checked and callbacks don't run.
+void ArgParser::finish() {
+    if (!parsing) {
+        resolveEnv();
+    }
+    bool requested = helpRequested() || versionRequested();
+    bool ok = checkFinish(requested);
+    endParse();
+    if (ok && !requested) {
+        runCallbacks();
+    }
+}
+
+
+// Run the end-of-parse checks for the found command, then for this parser.
+// Returns true if neither has collected an error.
+bool ArgParser::checkFinish(bool requested) {
+    bool ok = true;
+    if (found_command != nullptr) {
+        ok = found_command->checkFinish(requested);
+    }
+
+    if (pending_option != nullptr) {
+        if (pending_index == string::npos) {
+            reportError("missing argument for --" + pending_arg + ".");
+        } else if (pending_arg.size() > 1) {
+            string name(1, pending_arg[pending_index]);
+            reportError("missing argument for '" + name + "' in -" + pending_arg + ".");
+        } else {
+            reportError("missing argument for -" + pending_arg + ".");
+        }
+    }
+
+    if (pending_help) {
+        reportError("the help command requires an argument.");
+    }
+
+    if (constraints != nullptr && !requested) {
+        checkConstraints();
+    }
+
+    return ok && error_messages.empty();
+}
+
+
+// Clear the resumable parse state of this parser and the found command.
+void ArgParser::endParse() {
+    if (found_command != nullptr) {
+        found_command->endParse();
+    }
+    pending_option = nullptr;
+    pending_help = false;
+    found_command = nullptr;
+    options_done = false;
+    is_first_arg = true;
+    parsing = false;
+}
+
+
+// Run the callbacks of the found commands, innermost first.
+void ArgParser::runCallbacks() {
+    if (commandFound()) {
+        ArgParser& command_parser = commandParser();
+        command_parser.runCallbacks();
+        if (command_parser.callback != nullptr) {
+            command_parser.callback(command_name, command_parser);
         }
+    }
+}
 
-        // Otherwise add the argument to our list of positional arguments.
-        args.push_back(arg);
-        is_first_arg = false;
+
+// Parse a stream of string arguments.
+void ArgParser::parse(ArgStream& stream) {
+    while (stream.hasNext()) {
+        feed(stream.next());
     }
+    finish();
 }
 
 
 // Parse an array of string arguments. We assume that [argc] and [argv] are the
 // original parameters passed to main() and skip the first element. In some
 // situations [argv] can be empty, i.e. [argc == 0]. This can lead to security
-// vulnerabilities if not handled explicitly.
+// vulnerabilities if not handled explicitly. If the ARGS_COMPLETE environment
+// variable is set, we answer a shell completion request instead and exit.
 void ArgParser::parse(int argc, char **argv) {
-    if (argc > 1) {
-        ArgStream stream;
-        for (int i = 1; i < argc; i++) {
-            stream.append(argv[i]);
+    char const* completion = getenv("ARGS_COMPLETE");
+    if (completion != nullptr) {
+        string line(completion);
+        char const* point = getenv("ARGS_COMPLETE_POINT");
+        if (point != nullptr) {
+            line = line.substr(0, min<size_t>(strtoul(point, nullptr, 10), line.size()));
         }
-        parse(stream);
+        exitCompletion(line);
+    }
+
+    vector<string> args;
+    if (argc > 1) {
+        args.assign(argv + 1, argv + argc);
     }
+    parse(args);
 }
 
 
 // Parse a vector of string arguments.
-void ArgParser::parse(vector<string> args) {
-    ArgStream stream;
-    for (string& arg: args) {
-        stream.append(arg);
-    }
+void ArgParser::parse(vector<string> const& args) {
+    ArgStream stream(args);
     parse(stream);
 }
 
 
+// Clear the results of the previous parse, recursively through any commands.
+// Registered flags, options and commands are kept, as is the capacity of the
+// result vectors, so a parser can be reused for a new parse without allocating.
+void ArgParser::reset() {
+    args.clear();
+    arena.clear();
+    command_name.clear();
+    fill(flag_counts.begin(), flag_counts.end(), 0);
+    hash_sum = 0;
+    args_hash = 0;
+    found_command = nullptr;
+    pending_option = nullptr;
+    pending_help = false;
+    options_done = false;
+    is_first_arg = true;
+    parsing = false;
+    error_messages.clear();
+    help_requested = false;
+    version_requested = false;
+    for (auto& element: options) {
+        element.second->values.clear();
+        element.second->has_env = false;
+        element.second->taken = false;
+        element.second->chain = 0;
+        if (element.second->map != nullptr) {
+            element.second->map->clear();
+        }
+    }
+    for (auto& element: commands) {
+        element.second->reset();
+    }
+}
+
+
 // -----------------------------------------------------------------------------
 // ArgParser: utilities.
 // -----------------------------------------------------------------------------
 
 
-// Override the << stream insertion operator to support vectors. This will
-// allow us to cout our lists of option values in the print() method.
-template<typename T>
-static ostream& operator<<(ostream& stream, const vector<T>& vec) {
-    stream << "[";
-    for(size_t i = 0; i < vec.size(); ++i) {
-        if (i) cout << ", ";
-        stream << vec[i];
-    }
-    stream << "]";
-    return stream;
-}
-
-
 // Dump the parser's state to stdout.
-void ArgParser::print() {
-    cout << "Options:\n";
+void ArgParser::print() const {
+    Sink out(1);
+
+    out << "Options:\n";
     if (options.size() > 0) {
         for (auto element: options) {
-            cout << "  " << element.first << ": ";
+            out << "  " << element.first << ": ";
             Option *option = element.second;
-            cout << "(" << option->fallback << ") ";
-            cout << option->values;
-            cout << "\n";
+            out << "(" << option->fallback << ") ";
+            out << "[";
+            for (size_t i = 0; i < option->values.size(); ++i) {
+                if (i) out << ", ";
+                out << text(option->values[i]);
+            }
+            out << "]";
+            out << "\n";
         }
     } else {
-        cout << "  [none]\n";
+        out << "  [none]\n";
     }
 
-    cout << "\nFlags:\n";
+    out << "\nFlags:\n";
     if (flags.size() > 0) {
         for (auto element: flags) {
-            cout << "  " << element.first << ": " << element.second->count << "\n";
+            out << "  " << element.first << ": " << size_t(flag_counts[element.second]) << "\n";
         }
     } else {
-        cout << "  [none]\n";
+        out << "  [none]\n";
     }
 
-    cout << "\nArguments:\n";
+    out << "\nArguments:\n";
     if (args.size() > 0) {
         for (auto arg: args) {
-            cout << "  " << arg << "\n";
+            out << "  " << arg << "\n";
         }
     } else {
-        cout << "  [none]\n";
+        out << "  [none]\n";
     }
 
-    cout << "\nCommand:\n";
+    out << "\nCommand:\n";
     if (commandFound()) {
-        cout << "  " << command_name << "\n";
+        out << "  " << command_name << "\n";
     } else {
-        cout << "  [none]\n";
+        out << "  [none]\n";
     }
 }
 
 
-// Print the parser's help text and exit.
+// Print the parser's help text and exit. In collect-errors mode the request
+// is recorded for helpRequested() instead and the parse carries on.
 void ArgParser::exitHelp() {
-    cout << helptext << endl;
+    if (collect_errors) {
+        help_requested = true;
+        return;
+    }
+    Sink out(1);
+    out << helptext << "\n";
+    out.flush();
     exit(0);
 }
 
 
-// Print the parser's version string and exit.
+// Print the parser's version string and exit, or in collect-errors mode
+// record the request for versionRequested().
 void ArgParser::exitVersion() {
-    cout << version << endl;
+    if (collect_errors) {
+        version_requested = true;
+        return;
+    }
+    Sink out(1);
+    out << version << "\n";
+    out.flush();
+    exit(0);
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: shell completion.
+// -----------------------------------------------------------------------------
+
+
+// Print each name in [names] which begins with [prefix] and whose length is
+// (for [single] true) or isn't (for [single] false) one character. The maps
+// are sorted, so the matches are found with one binary search rather than a
+// scan, however many names are registered.
+template<typename Map>
+static void completeNames(
+    Sink& out,
+    Map const& names,
+    string const& prefix,
+    char const* dashes,
+    int single) {
+
+    for (auto iter = names.lower_bound(prefix); iter != names.end(); ++iter) {
+        string const& name = iter->first;
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            break;
+        }
+        if (single < 0 || (name.size() == 1) == (single == 1)) {
+            out << dashes << name << "\n";
+        }
+    }
+}
+
+
+// Answer a shell completion request and exit. [line] is the command line up
+// to the cursor, including the program name. The complete words before the
+// cursor are walked without side effects to find the active command parser
+// and whether an option is waiting for its value; the final, partial word is
+// then completed against that parser's names. Words are split on whitespace;
+// quoting isn't interpreted.
+void ArgParser::exitCompletion(string const& line) {
+    vector<string> words;
+    size_t pos = 0;
+    while (true) {
+        size_t start = line.find_first_not_of(" \t\n", pos);
+        if (start == string::npos) {
+            words.push_back(string());
+            break;
+        }
+        pos = line.find_first_of(" \t\n", start);
+        words.push_back(line.substr(start, pos - start));
+        if (pos == string::npos) {
+            break;
+        }
+    }
+
+    ArgParser const* parser = this;
+    bool is_first = true;
+    bool after_help = false;
+    bool options_done = false;
+    size_t values_due = 0;
+
+    for (size_t i = 1; i + 1 < words.size(); i++) {
+        string const& word = words[i];
+        after_help = false;
+        if (values_due > 0) {
+            values_due--;
+        } else if (options_done) {
+            continue;
+        } else if (word == "--") {
+            options_done = true;
+        } else if (word.compare(0, 2, "--") == 0) {
+            string name = word.substr(2);
+            if (name.find('=') == string::npos && parser->options.count(name) > 0) {
+                values_due = 1;
+            }
+        } else if (word.size() > 1 && word[0] == '-' && !isdigit(word[1])) {
+            for (size_t j = 1; j < word.size() && word.find('=') == string::npos; j++) {
+                values_due += parser->options.count(string(1, word[j]));
+            }
+        } else if (is_first && parser->commands.count(word) > 0) {
+            parser = parser->commands.find(word)->second;
+        } else if (is_first && word == "help" && parser->commands.size() > 0) {
+            after_help = true;
+            is_first = false;
+        } else {
+            is_first = false;
+        }
+    }
+
+    Sink out(1);
+    string const& partial = words.size() > 1 ? words.back() : string();
+
+    if (words.size() < 2 || values_due > 0 || options_done) {
+        // Nothing to complete.
+    } else if (after_help) {
+        completeNames(out, parser->commands, partial, "", -1);
+    } else if (partial.compare(0, 2, "--") == 0) {
+        string prefix = partial.substr(2);
+        completeNames(out, parser->flags, prefix, "--", 0);
+        completeNames(out, parser->options, prefix, "--", 0);
+        if (parser->helptext != "" && string("help").compare(0, prefix.size(), prefix) == 0) {
+            out << "--help\n";
+        }
+        if (parser->version != "" && string("version").compare(0, prefix.size(), prefix) == 0) {
+            out << "--version\n";
+        }
+    } else if (partial == "-") {
+        completeNames(out, parser->flags, "", "-", 1);
+        completeNames(out, parser->options, "", "-", 1);
+        completeNames(out, parser->flags, "", "--", 0);
+        completeNames(out, parser->options, "", "--", 0);
+    } else if (partial.empty() || partial[0] != '-') {
+        if (is_first) {
+            completeNames(out, parser->commands, partial, "", -1);
+            if (parser->commands.size() > 0 && string("help").compare(0, partial.size(), partial) == 0) {
+                out << "help\n";
+            }
+        }
+    }
+
+    out.flush();
     exit(0);
 }
 
@@ -451,6 +3430,16 @@ void ArgParser::exitVersion() {
 
 
 ArgParser::~ArgParser() {
+    unwatchConfig();
+    release();
+    delete live_domain.load();
+}
+
+
+// Delete the options and command parsers owned by this instance. Each
+// may be registered under several aliases so we collect the unique pointers
+// first.
+void ArgParser::release() {
     set<Option*> unique_options;
     for (auto element: options) {
         unique_options.insert(element.second);
@@ -459,14 +3448,6 @@ ArgParser::~ArgParser() {
         delete pointer;
     }
 
-    set<Flag*> unique_flags;
-    for (auto element: flags) {
-        unique_flags.insert(element.second);
-    }
-    for (auto pointer: unique_flags) {
-        delete pointer;
-    }
-
     set<ArgParser*> unique_cmd_parsers;
     for (auto element: commands) {
         unique_cmd_parsers.insert(element.second);
@@ -474,4 +3455,109 @@ ArgParser::~ArgParser() {
     for (auto pointer: unique_cmd_parsers) {
         delete pointer;
     }
+
+    options.clear();
+    env_bindings.clear();
+    env_parsers.clear();
+    flags.clear();
+    flag_counts.clear();
+    config_flag_counts.clear();
+    flag_identities.clear();
+    commands.clear();
+    delete option_index;
+    delete value_index;
+    delete command_index;
+    delete constraints;
+    option_index = nullptr;
+    value_index = nullptr;
+    command_index = nullptr;
+    constraints = nullptr;
+}
+
+
+// -----------------------------------------------------------------------------
+// ArgParser: move semantics.
+// -----------------------------------------------------------------------------
+
+
+// Command parsers are heap-allocated and owned through pointers, so references
+// returned by command() remain valid after their parent is moved. Moving a
+// parser stops its config file watcher.
+ArgParser::ArgParser(ArgParser&& other) : ArgParser() {
+    *this = std::move(other);
+}
+
+
+ArgParser& ArgParser::operator=(ArgParser&& other) {
+    if (this != &other) {
+        other.unwatchConfig();
+        unwatchConfig();
+        release();
+        args = std::move(other.args);
+        helptext = std::move(other.helptext);
+        version = std::move(other.version);
+        callback = other.callback;
+        options = std::move(other.options);
+        flags = std::move(other.flags);
+        flag_counts = std::move(other.flag_counts);
+        config_flag_counts = std::move(other.config_flag_counts);
+        commands = std::move(other.commands);
+        env_bindings = std::move(other.env_bindings);
+        env_parsers = std::move(other.env_parsers);
+        replace(env_parsers.begin(), env_parsers.end(), &other, this);
+        for (auto& element: commands) {
+            element.second->parent = this;
+        }
+        command_name = std::move(other.command_name);
+        flag_identities = std::move(other.flag_identities);
+        identity = other.identity;
+        hash_sum = other.hash_sum;
+        args_hash = other.args_hash;
+        hash_values_ordered = other.hash_values_ordered;
+        hash_args_ordered = other.hash_args_ordered;
+        found_command = other.found_command;
+        pending_option = other.pending_option;
+        pending_arg = std::move(other.pending_arg);
+        pending_index = other.pending_index;
+        pending_help = other.pending_help;
+        options_done = other.options_done;
+        is_first_arg = other.is_first_arg;
+        parsing = other.parsing;
+        abbreviations = other.abbreviations;
+        collect_errors = other.collect_errors;
+        constraints = other.constraints;
+        error_messages = std::move(other.error_messages);
+        help_requested = other.help_requested;
+        version_requested = other.version_requested;
+        option_index = other.option_index;
+        value_index = other.value_index;
+        command_index = other.command_index;
+        arena = std::move(other.arena);
+        config_path = std::move(other.config_path);
+        delete live_domain.exchange(other.live_domain.exchange(nullptr));
+        other.options.clear();
+        other.flags.clear();
+        other.flag_counts.clear();
+        other.config_flag_counts.clear();
+        other.flag_identities.clear();
+        other.hash_sum = 0;
+        other.args_hash = 0;
+        other.found_command = nullptr;
+        other.pending_option = nullptr;
+        other.pending_help = false;
+        other.help_requested = false;
+        other.version_requested = false;
+        other.options_done = false;
+        other.is_first_arg = true;
+        other.parsing = false;
+        other.option_index = nullptr;
+        other.value_index = nullptr;
+        other.command_index = nullptr;
+        other.constraints = nullptr;
+        other.commands.clear();
+        other.env_bindings.clear();
+        other.env_parsers.clear();
+        other.config_path.clear();
+    }
+    return *this;
 }
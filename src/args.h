@@ -9,25 +9,53 @@
 #ifndef args_h
 #define args_h
 
+#include <atomic>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace args {
 
     struct ArgStream;
     struct Option;
-    struct Flag;
+    struct Span;
+    struct LiveDomain;
+    struct ConfigWatcher;
+    class MappedFile;
+    struct CacheState;
+    struct NameIndex;
+    struct Constraints;
+    struct ChoiceSet;
+    struct MapIndex;
 
     class ArgParser {
         public:
             ArgParser(
                 std::string const& helptext = "",
                 std::string const& version = ""
-            ) : helptext(helptext), version(version) {}
+            ) : helptext(helptext), version(version), callback(nullptr), parent(nullptr),
+                identity(0), hash_sum(0), args_hash(0), hash_values_ordered(true),
+                hash_args_ordered(true), found_command(nullptr), pending_option(nullptr),
+                pending_index(0), pending_help(false), options_done(false),
+                is_first_arg(true), parsing(false), collect_errors(false), help_requested(false),
+                version_requested(false), abbreviations(false),
+                option_index(nullptr), value_index(nullptr), command_index(nullptr),
+                constraints(nullptr),
+                live_domain(nullptr),
+                config_watcher(nullptr) {}
 
             ~ArgParser();
 
+            // Parsers own their flags, options and commands so they can be
+            // moved but not copied.
+            ArgParser(ArgParser&& other);
+            ArgParser& operator=(ArgParser&& other);
+            ArgParser(ArgParser const&) = delete;
+            ArgParser& operator=(ArgParser const&) = delete;
+
             // Stores positional arguments.
             std::vector<std::string> args;
 
@@ -42,15 +70,91 @@ namespace args {
             void flag(std::string const& name);
             void option(std::string const& name, std::string const& fallback = "");
 
-            // Parse the application's command line arguments.
+            // Register an option whose value must be one of a space-separated
+            // list of choices. choiceIndex() returns the value's index in the
+            // list, or -1, so applications can switch on it.
+            void choice(
+                std::string const& name,
+                std::string const& choices,
+                std::string const& fallback = ""
+            );
+            int choiceIndex(std::string const& name) const;
+
+            // Register an option whose values are 'key=value' pairs, e.g.
+            // '-D key=value', split on the first '='. lookup() returns the
+            // last value given for a key, or an empty string. Without command
+            // line values the env or config value is looked up, as value().
+            void mapOption(std::string const& name);
+            std::string lookup(std::string const& name, std::string const& key) const;
+            bool hasKey(std::string const& name, std::string const& key) const;
+
+            // Accept unambiguous prefixes of long option and command names,
+            // e.g. '--verb' for '--verbose'. Applies to this parser and its
+            // commands.
+            void setAbbreviations(bool enabled);
+
+            // Constraints, checked when the parse finishes: a required flag
+            // or option, a space-separated group of which at most one may be
+            // found, and a flag or option which depends on another.
+            bool require(std::string const& name);
+            bool exclusive(std::string const& names);
+            bool depends(std::string const& name, std::string const& other);
+
+            // Bind an option to an environment variable which supplies its
+            // value if the option isn't found on the command line.
+            bool env(std::string const& name, std::string const& variable);
+
+            // Load flag and option values from a file of 'key = value' lines.
+            // Values found on the command line take precedence.
+            bool loadConfig(std::string const& path);
+
+            // Reload the config file, publishing changed values as live
+            // values. watchConfig() reloads automatically on SIGHUP or when
+            // the file changes.
+            bool reloadConfig();
+            bool watchConfig();
+            void unwatchConfig();
+
+            // Parse the application's command line arguments. If the
+            // ARGS_COMPLETE environment variable is set, print completions
+            // for the partial command line it holds and exit instead.
             void parse(int argc, char **argv);
-            void parse(std::vector<std::string> args);
+            void parse(std::vector<std::string> const& args);
+
+            // Parse arguments one at a time as they arrive. Call finish()
+            // after the last argument. parse() is equivalent to feeding each
+            // argument in turn, then calling finish().
+            void feed(std::string const& arg);
+            void finish();
+
+            // Collect parse errors rather than exiting at the first one. The
+            // parse carries on past each error; errors() returns them all.
+            // Requests for help or the version are recorded rather than
+            // printed, so the parse never exits.
+            void setCollectErrors(bool enabled);
+            std::vector<std::string> errors() const;
+            bool helpRequested() const;
+            bool versionRequested() const;
 
-            // Retrieve flag and option values.
-            bool found(std::string const& name);
-            int count(std::string const& name);
-            std::string value(std::string const& name);
-            std::vector<std::string> values(std::string const& name);
+            // Clear parse results so the parser can be reused.
+            void reset();
+
+            // Retrieve flag and option values. These (and the other const
+            // methods) are safe to call from multiple threads after parse().
+            bool found(std::string const& name) const;
+            int count(std::string const& name) const;
+            std::string value(std::string const& name) const;
+            std::vector<std::string> values(std::string const& name) const;
+
+            // Copy results out of the parser, clearing them.
+            std::vector<std::string> takeArgs();
+            std::vector<std::string> takeValues(std::string const& name);
+
+            // Runtime updates. setLiveValue() atomically publishes a new value
+            // for an option; liveValue() returns the latest published value,
+            // or value() if none has been published. Readers never block.
+            bool setLiveValue(std::string const& name, std::string const& value);
+            std::string liveValue(std::string const& name) const;
 
             // Register a command. Returns the command's ArgParser instance.
             ArgParser& command(
@@ -60,26 +164,214 @@ namespace args {
             );
 
             // Utilities for handling commands manually.
-            bool commandFound();
-            std::string commandName();
+            bool commandFound() const;
+            std::string commandName() const;
             ArgParser& commandParser();
+            ArgParser const& commandParser() const;
+
+            // Serialize the parse result into a compact, position-independent
+            // buffer which a Snapshot can query in place, e.g. from shared
+            // memory. saveSnapshot() writes the buffer to a file.
+            std::string snapshot() const;
+            bool saveSnapshot(std::string const& path) const;
+
+            // A hash of the parse result's meaning rather than its spelling.
+            // Aliases, short-flag clusters and --name=value forms hash the
+            // same as their equivalents, and the relative order of different
+            // flags and options is ignored. setHashOrder() controls whether
+            // the order of an option's repeated values and of the positional
+            // arguments is significant (both are by default).
+            uint64_t canonicalHash() const;
+            void setHashOrder(bool values_ordered, bool args_ordered);
 
             // Print a parser instance to stdout.
-            void print();
+            void print() const;
 
         private:
             std::map<std::string, Option*> options;
-            std::map<std::string, Flag*> flags;
+            std::map<std::string, size_t> flags;
+            std::vector<int> flag_counts;
+            std::vector<int> config_flag_counts;
             std::map<std::string, ArgParser*> commands;
             std::string command_name;
 
+            // Environment variable bindings, keyed by the hash of the
+            // variable's name. Each parser also lists the parsers in its
+            // command tree that have bindings, so resolving them is a single
+            // pass over the environment.
+            std::unordered_multimap<uint64_t, std::pair<std::string, Option*>> env_bindings;
+            std::vector<ArgParser*> env_parsers;
+            ArgParser* parent;
+
+            // Canonical hash state, updated as arguments are parsed. Each
+            // flag, option and command is identified by the hash of the first
+            // name it was registered under.
+            std::vector<uint64_t> flag_identities;
+            uint64_t identity;
+            uint64_t hash_sum;
+            uint64_t args_hash;
+            bool hash_values_ordered;
+            bool hash_args_ordered;
+
+            // Resumable parse state. An option found without its value waits
+            // for the next argument; [pending_arg] and [pending_index] locate
+            // it within the argument it was found in.
+            ArgParser* found_command;
+            Option* pending_option;
+            std::string pending_arg;
+            size_t pending_index;
+            bool pending_help;
+            bool options_done;
+            bool is_first_arg;
+            bool parsing;
+
+            // Errors and help or version requests found by the current parse
+            // in collect-errors mode.
+            bool collect_errors;
+            std::vector<std::string> error_messages;
+            bool help_requested;
+            bool version_requested;
+
+            // Prefix indexes of the long flag and option names, the long
+            // option names alone (for '--name=value'), and the command names,
+            // built when first needed and discarded when a name is registered.
+            bool abbreviations;
+            NameIndex* option_index;
+            NameIndex* value_index;
+            NameIndex* command_index;
+
+            // Constraints on the parse result, created by the first call to
+            // require(), exclusive() or depends().
+            Constraints* constraints;
+
+            // Parsed option values are stored back to back in a single buffer.
+            std::string arena;
+
+            // Synchronizes readers and writers of live values. Created by the
+            // first call to setLiveValue().
+            std::atomic<LiveDomain*> live_domain;
+
+            // The most recently loaded config file and its watcher thread.
+            std::string config_path;
+            ConfigWatcher* config_watcher;
+
             void parse(ArgStream& args);
             void registerOption(std::string const& name, Option* option);
-            void parseLongOption(std::string arg, ArgStream& stream);
-            void parseShortOption(std::string arg, ArgStream& stream);
+            void parseLongOption(std::string arg);
+            void parseShortOption(std::string const& arg, size_t start);
+            void appendValue(Option* option, std::string const& value);
+            void indexMapValue(Option* option, Span const& span);
+            bool findKey(Option const* option, std::string const& key, std::string* value) const;
+            void appendArg(std::string const& arg);
+            void countFlag(size_t id);
+            std::string text(Span const& span) const;
             void parseEqualsOption(std::string prefix, std::string name, std::string value);
             void exitHelp();
             void exitVersion();
+            void exitCompletion(std::string const& line);
+            std::string expandOption(
+                std::string const& prefix,
+                std::string const& dashes,
+                bool& ambiguous,
+                bool options_only = false
+            );
+            std::string expandCommand(std::string const& prefix, bool& ambiguous);
+            void reportError(std::string const& message);
+            Constraints& constraintSet();
+            long constraintBit(std::string const& name);
+            void checkConstraints();
+            bool checkFinish(bool requested);
+            void endParse();
+            void runCallbacks();
+            std::string suggest(
+                std::string const& word,
+                std::string const& dashes,
+                bool command,
+                bool options_only = false
+            ) const;
+            void release();
+            void resolveEnv();
+            std::string setConfigValue(std::string const& key, std::string const& value);
+            LiveDomain* liveDomain();
+            void publish(Option* option, std::string const& value);
+            void writeSnapshot(std::string& buffer, size_t node) const;
+            size_t writeRecord(std::string& buffer, std::string const& name, Option const* option) const;
+    };
+
+    // A read-only view of a parse result serialized by ArgParser::snapshot(),
+    // with the same accessors as the parser. The buffer is read in place so
+    // any number of processes can share one copy.
+    class Snapshot {
+        public:
+            Snapshot() : data(nullptr), size(0), node(0), file(nullptr) {}
+            Snapshot(void const* data, size_t size);
+            ~Snapshot();
+
+            Snapshot(Snapshot&& other);
+            Snapshot& operator=(Snapshot&& other);
+            Snapshot(Snapshot const&) = delete;
+            Snapshot& operator=(Snapshot const&) = delete;
+
+            // Map a snapshot file written by ArgParser::saveSnapshot().
+            bool load(std::string const& path);
+
+            // False if the buffer or file isn't a snapshot.
+            bool valid() const;
+
+            std::vector<std::string> args() const;
+            bool found(std::string const& name) const;
+            int count(std::string const& name) const;
+            std::string value(std::string const& name) const;
+            std::vector<std::string> values(std::string const& name) const;
+            int choiceIndex(std::string const& name) const;
+            std::string lookup(std::string const& name, std::string const& key) const;
+            bool hasKey(std::string const& name, std::string const& key) const;
+
+            // Errors and help or version requests collected in collect-errors
+            // mode.
+            std::vector<std::string> errors() const;
+            bool helpRequested() const;
+            bool versionRequested() const;
+
+            bool commandFound() const;
+            std::string commandName() const;
+            Snapshot commandParser() const;
+
+        private:
+            char const* data;
+            size_t size;
+            size_t node;
+            MappedFile* file;
+
+            void attach(void const* data, size_t size);
+            size_t find(std::string const& name) const;
+            size_t findKey(std::string const& name, std::string const& key) const;
+            size_t commandNode() const;
+            std::string text(size_t ref) const;
+    };
+
+    // An LRU cache of parse results in front of a parser, keyed by the raw
+    // argument list. A hit returns the cached result without re-parsing. The
+    // cache's memory use, including its keys, is bounded by [capacity] bytes.
+    class ParseCache {
+        public:
+            ParseCache(ArgParser& parser, size_t capacity);
+            ~ParseCache();
+            ParseCache(ParseCache const&) = delete;
+            ParseCache& operator=(ParseCache const&) = delete;
+
+            // Return the parse result for the argument list. Thread-safe;
+            // misses reset and reuse the parser.
+            std::shared_ptr<Snapshot const> parse(std::vector<std::string> const& args);
+            std::shared_ptr<Snapshot const> parse(int argc, char **argv);
+
+            size_t hits() const;
+            size_t misses() const;
+            size_t size() const;
+            void clear();
+
+        private:
+            CacheState* state;
     };
 }
 
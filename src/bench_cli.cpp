@@ -0,0 +1,59 @@
+// -----------------------------------------------------------------------------
+// Startup benchmark subject. This is example1/example2 with a configurable
+// spec size, compiled once per variant by `make bench-startup`:
+//
+//   -DBENCH_BASELINE       an empty main() that doesn't touch the library
+//   -DBENCH_SIZE=n         register n flags and n options
+//   -DBENCH_COMMANDS=n     register n commands, each with the spec above
+// -----------------------------------------------------------------------------
+
+#ifdef BENCH_BASELINE
+
+int main() {
+    return 0;
+}
+
+#else
+
+#include <string>
+#include "args.h"
+
+#ifndef BENCH_SIZE
+    #define BENCH_SIZE 2
+#endif
+
+#ifndef BENCH_COMMANDS
+    #define BENCH_COMMANDS 0
+#endif
+
+using namespace args;
+using namespace std;
+
+static void registerSpec(ArgParser& parser) {
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    for (int i = 0; i < BENCH_SIZE; i++) {
+        parser.flag("flag-" + to_string(i));
+        parser.option("opt-" + to_string(i), "default");
+    }
+}
+
+int main(int argc, char **argv) {
+    ArgParser parser("Usage: bench...", "1.0");
+
+    if (BENCH_COMMANDS > 0) {
+        for (int i = 0; i < BENCH_COMMANDS; i++) {
+            registerSpec(parser.command("cmd-" + to_string(i), "Usage: bench cmd..."));
+        }
+    } else {
+        registerSpec(parser);
+    }
+
+    parser.parse(argc, argv);
+    parser.print();
+    if (parser.commandFound()) {
+        parser.commandParser().print();
+    }
+}
+
+#endif
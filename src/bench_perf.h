@@ -0,0 +1,106 @@
+// -----------------------------------------------------------------------------
+// Hardware performance counters for the benchmarks. Wraps Linux
+// perf_event_open() to count instructions, cycles, cache misses and branch
+// misses for the calling thread between start() and stop(). Each counter is
+// opened independently, so if one is unavailable (common in containers and
+// VMs, or with a strict perf_event_paranoid setting) the others still work.
+// Unavailable counters report -1. On other platforms all counters report -1.
+// -----------------------------------------------------------------------------
+
+#ifndef bench_perf_h
+#define bench_perf_h
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+class PerfCounters {
+    public:
+        enum { INSTRUCTIONS, CYCLES, CACHE_MISSES, BRANCH_MISSES, COUNT };
+
+        // Counter values from the last start()/stop() pair.
+        int64_t values[COUNT];
+
+        PerfCounters() {
+            for (int i = 0; i < COUNT; i++) {
+                fds[i] = -1;
+                values[i] = -1;
+            }
+#ifdef __linux__
+            uint64_t configs[COUNT] = {
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_CACHE_MISSES,
+                PERF_COUNT_HW_BRANCH_MISSES,
+            };
+            for (int i = 0; i < COUNT; i++) {
+                struct perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = configs[i];
+                attr.disabled = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            }
+#endif
+        }
+
+        ~PerfCounters() {
+#ifdef __linux__
+            for (int i = 0; i < COUNT; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+#endif
+        }
+
+        // True if at least one counter could be opened.
+        bool available() const {
+            for (int i = 0; i < COUNT; i++) {
+                if (fds[i] >= 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void start() {
+#ifdef __linux__
+            for (int i = 0; i < COUNT; i++) {
+                if (fds[i] >= 0) {
+                    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+        }
+
+        void stop() {
+#ifdef __linux__
+            for (int i = 0; i < COUNT; i++) {
+                values[i] = -1;
+                if (fds[i] >= 0) {
+                    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+                    int64_t count;
+                    if (read(fds[i], &count, sizeof(count)) == sizeof(count)) {
+                        values[i] = count;
+                    }
+                }
+            }
+#endif
+        }
+
+    private:
+        int fds[COUNT];
+};
+
+#endif
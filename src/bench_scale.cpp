@@ -0,0 +1,338 @@
+// -----------------------------------------------------------------------------
+// Scaling benchmark. Generates synthetic specs and argvs of increasing size,
+// times registration, parsing, lookups and teardown, and emits one CSV row per
+// phase with wall time and, where available, hardware counters (see
+// bench_perf.h). Run via `make bench-scale` or directly, e.g.
+//
+//   bin/bench_scale --options 10 --options 100000 --tokens 1000000
+//   bin/bench_scale --depth 2 --fanout 8 --mix long=1,short=4,pos=1
+//
+// The --options count is the total across the command tree and is split
+// evenly between the leaf parsers. Each argv descends a random path to a leaf
+// and then fills the remaining tokens according to the --mix weights, so
+// `--mix short=1` isolates short-option clusters and `--mix long=1` long-option
+// lookups.
+// -----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include "args.h"
+#include "bench_perf.h"
+
+using namespace args;
+using namespace std;
+
+struct Config {
+    size_t options;
+    size_t depth;
+    size_t fanout;
+    size_t tokens;
+    double weights[4];
+};
+
+struct Leaf {
+    ArgParser* parser;
+    vector<string> path;
+    size_t flags;
+    size_t opts;
+};
+
+enum { LONG, SHORT, EQUALS, POS };
+
+// Keeps the lookup results alive so the lookups can't be optimized away.
+static volatile size_t checksum = 0;
+
+static double micros(chrono::steady_clock::time_point start) {
+    auto elapsed = chrono::steady_clock::now() - start;
+    return chrono::duration<double, micro>(elapsed).count();
+}
+
+// Short names are drawn from the letters, lowercase for flags and uppercase
+// for options, so only the first 26 of each get one.
+static string flagName(size_t i) {
+    string name = "flag-" + to_string(i);
+    if (i < 26) {
+        name += " " + string(1, char('a' + i));
+    }
+    return name;
+}
+
+static string optionName(size_t i) {
+    string name = "opt-" + to_string(i);
+    if (i < 26) {
+        name += " " + string(1, char('A' + i));
+    }
+    return name;
+}
+
+// Register half flags, half options on each leaf.
+static void registerSpec(ArgParser& parser, size_t count, Leaf& leaf) {
+    leaf.flags = count / 2;
+    leaf.opts = count - leaf.flags;
+    for (size_t i = 0; i < leaf.flags; i++) {
+        parser.flag(flagName(i));
+    }
+    for (size_t i = 0; i < leaf.opts; i++) {
+        parser.option(optionName(i), "default");
+    }
+}
+
+// Build a command tree of the given depth and fanout, collecting the leaves.
+static void buildTree(
+    ArgParser& parser,
+    size_t depth,
+    Config const& config,
+    vector<string>& path,
+    vector<Leaf>& leaves,
+    size_t per_leaf) {
+
+    if (depth == config.depth) {
+        Leaf leaf;
+        leaf.parser = &parser;
+        leaf.path = path;
+        registerSpec(parser, per_leaf, leaf);
+        leaves.push_back(leaf);
+        return;
+    }
+
+    for (size_t i = 0; i < config.fanout; i++) {
+        string name = "cmd-" + to_string(i);
+        path.push_back(name);
+        buildTree(parser.command(name), depth + 1, config, path, leaves, per_leaf);
+        path.pop_back();
+    }
+}
+
+// Generate an argv for the given leaf.
+static vector<string> generateArgv(Leaf const& leaf, Config const& config, mt19937& rng) {
+    vector<string> argv = leaf.path;
+    discrete_distribution<int> kind(config.weights, config.weights + 4);
+
+    while (argv.size() < config.tokens) {
+        int k = kind(rng);
+        if (k == SHORT && leaf.flags > 0) {
+            string cluster = "-";
+            size_t letters = min<size_t>(leaf.flags, 26);
+            for (int i = 0; i < 3; i++) {
+                cluster += char('a' + rng() % letters);
+            }
+            argv.push_back(cluster);
+        } else if (k == EQUALS && leaf.opts > 0) {
+            argv.push_back("--opt-" + to_string(rng() % leaf.opts) + "=value");
+        } else if (k == LONG && leaf.opts > 0 && argv.size() + 2 <= config.tokens
+            && (rng() % 2 || leaf.flags == 0)) {
+            argv.push_back("--opt-" + to_string(rng() % leaf.opts));
+            argv.push_back("value");
+        } else if (k == LONG && leaf.flags > 0) {
+            argv.push_back("--flag-" + to_string(rng() % leaf.flags));
+        } else {
+            argv.push_back("pos");
+        }
+    }
+
+    return argv;
+}
+
+// Print one CSV row for a measured phase.
+static void report(
+    Config const& config,
+    size_t tokens,
+    size_t rep,
+    char const* phase,
+    size_t items,
+    double us,
+    PerfCounters const& perf) {
+
+    printf("%zu,%zu,%zu,%zu,%zu,%s,%zu,%.1f,%.2f",
+        config.options,
+        config.depth,
+        config.fanout,
+        tokens,
+        rep,
+        phase,
+        items,
+        us,
+        items > 0 ? us * 1000 / items : 0.0
+    );
+    for (int i = 0; i < PerfCounters::COUNT; i++) {
+        if (perf.values[i] >= 0) {
+            printf(",%lld", (long long)perf.values[i]);
+        } else {
+            printf(",");
+        }
+    }
+    printf("\n");
+}
+
+static void run(Config const& config, size_t reps, mt19937& rng, PerfCounters& perf) {
+    size_t leaf_count = 1;
+    for (size_t i = 0; i < config.depth; i++) {
+        leaf_count *= config.fanout;
+    }
+    size_t per_leaf = max<size_t>(config.options / leaf_count, 1);
+
+    for (size_t rep = 0; rep < reps; rep++) {
+        auto start = chrono::steady_clock::now();
+        perf.start();
+        ArgParser* parser = new ArgParser();
+        vector<string> path;
+        vector<Leaf> leaves;
+        buildTree(*parser, 0, config, path, leaves, per_leaf);
+        perf.stop();
+        double us = micros(start);
+
+        Leaf& leaf = leaves[rng() % leaves.size()];
+        size_t names = leaf.flags + leaf.opts;
+        vector<string> argv = generateArgv(leaf, config, rng);
+        report(config, argv.size(), rep, "register", config.options, us, perf);
+
+        start = chrono::steady_clock::now();
+        perf.start();
+        parser->parse(argv);
+        perf.stop();
+        us = micros(start);
+        report(config, argv.size(), rep, "parse", argv.size(), us, perf);
+
+        vector<string> flag_names, option_names;
+        for (size_t i = 0; i < leaf.flags; i++) {
+            flag_names.push_back("flag-" + to_string(i));
+        }
+        for (size_t i = 0; i < leaf.opts; i++) {
+            option_names.push_back("opt-" + to_string(i));
+        }
+
+        start = chrono::steady_clock::now();
+        perf.start();
+        size_t hits = 0;
+        for (string const& name: flag_names) {
+            hits += leaf.parser->found(name);
+        }
+        for (string const& name: option_names) {
+            hits += leaf.parser->value(name).size();
+        }
+        perf.stop();
+        us = micros(start);
+        checksum += hits;
+        report(config, argv.size(), rep, "lookup", names, us, perf);
+
+        start = chrono::steady_clock::now();
+        perf.start();
+        delete parser;
+        perf.stop();
+        us = micros(start);
+        report(config, argv.size(), rep, "teardown", config.options, us, perf);
+    }
+}
+
+
+// Parse a mix string of the form "long=2,short=1,equals=1,pos=4".
+static void parseMix(string const& mix, double* weights) {
+    char const* names[] = {"long", "short", "equals", "pos"};
+    for (int i = 0; i < 4; i++) {
+        weights[i] = 0;
+    }
+    size_t start = 0;
+    while (start < mix.size()) {
+        size_t end = mix.find(',', start);
+        if (end == string::npos) {
+            end = mix.size();
+        }
+        string item = mix.substr(start, end - start);
+        size_t eq = item.find('=');
+        bool matched = false;
+        for (int i = 0; i < 4 && eq != string::npos; i++) {
+            if (item.substr(0, eq) == names[i]) {
+                weights[i] = atof(item.c_str() + eq + 1);
+                matched = true;
+            }
+        }
+        if (!matched) {
+            fprintf(stderr, "Error: invalid --mix entry '%s'.\n", item.c_str());
+            exit(1);
+        }
+        start = end + 1;
+    }
+}
+
+static vector<size_t> sizes(ArgParser& parser, string const& name) {
+    vector<size_t> result;
+    for (string const& value: parser.values(name)) {
+        result.push_back(strtoull(value.c_str(), nullptr, 10));
+    }
+    if (result.empty()) {
+        result.push_back(strtoull(parser.value(name).c_str(), nullptr, 10));
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    ArgParser parser(
+        "Usage: bench_scale [options]\n\n"
+        "Options (each numeric option may be repeated to sweep values):\n"
+        "  --options n    total flags + options registered (default: sweep)\n"
+        "  --tokens n     argv length in tokens (default: sweep)\n"
+        "  --depth n      command tree depth (default: 0)\n"
+        "  --fanout n     commands per tree level (default: 4)\n"
+        "  --mix spec     token mix weights (default: long=1,short=1,equals=1,pos=1)\n"
+        "  --reps n       repetitions per configuration (default: 3)\n"
+        "  --seed n       random seed (default: 1)"
+    );
+    parser.option("options o");
+    parser.option("tokens t");
+    parser.option("depth d", "0");
+    parser.option("fanout f", "4");
+    parser.option("mix m", "long=1,short=1,equals=1,pos=1");
+    parser.option("reps r", "3");
+    parser.option("seed s", "1");
+    parser.parse(argc, argv);
+
+    vector<size_t> option_counts = {10, 100, 1000, 10000, 100000};
+    vector<size_t> token_counts = {1, 100, 10000, 1000000};
+    if (parser.found("options")) {
+        option_counts = sizes(parser, "options");
+    }
+    if (parser.found("tokens")) {
+        token_counts = sizes(parser, "tokens");
+    }
+
+    // A tree with depth but no fanout would have no leaves to parse.
+    for (size_t fanout: sizes(parser, "fanout")) {
+        for (size_t depth: sizes(parser, "depth")) {
+            if (fanout == 0 && depth > 0) {
+                fprintf(stderr, "Error: --fanout must be at least 1 when --depth is above 0.\n");
+                exit(1);
+            }
+        }
+    }
+
+    Config config;
+    parseMix(parser.value("mix"), config.weights);
+    size_t reps = sizes(parser, "reps")[0];
+    mt19937 rng(sizes(parser, "seed")[0]);
+
+    PerfCounters perf;
+    if (!perf.available()) {
+        fprintf(stderr, "Warning: hardware counters unavailable, reporting wall time only.\n");
+    }
+
+    printf("options,depth,fanout,tokens,rep,phase,items,us,ns_per_item,"
+        "instructions,cycles,cache_misses,branch_misses\n");
+
+    for (size_t depth: sizes(parser, "depth")) {
+        for (size_t fanout: sizes(parser, "fanout")) {
+            for (size_t options: option_counts) {
+                for (size_t tokens: token_counts) {
+                    config.options = options;
+                    config.depth = depth;
+                    config.fanout = fanout;
+                    config.tokens = tokens;
+                    run(config, reps, rng, perf);
+                }
+            }
+        }
+    }
+}
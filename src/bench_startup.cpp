@@ -0,0 +1,152 @@
+// -----------------------------------------------------------------------------
+// Startup latency benchmark. Fork/execs each benchmark binary repeatedly with
+// a representative argv and reports exec-to-exit wall time and page faults.
+// Run via `make bench-startup`.
+// -----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "args.h"
+
+using namespace args;
+using namespace std;
+
+struct Variant {
+    string name;
+    vector<string> argv;
+};
+
+struct Result {
+    vector<double> micros;
+    long minflt = 0;
+    long majflt = 0;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Run a single fork/exec cycle, returning the wall time in microseconds.
+static double runOnce(vector<char*>& argv, Result& result) {
+    double start = now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        dup2(devnull, 2);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        exit(1);
+    }
+
+    double elapsed = now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s exited with status %d.\n", argv[0], status);
+        exit(1);
+    }
+
+    result.minflt += usage.ru_minflt;
+    result.majflt += usage.ru_majflt;
+    return elapsed;
+}
+
+static double percentile(vector<double>& sorted, double p) {
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+int main(int argc, char **argv) {
+    ArgParser parser(
+        "Usage: bench_startup [--runs n] [--bin dir]\n\n"
+        "Fork/execs each benchmark binary and reports p50/p99 wall time\n"
+        "and the mean number of page faults per run."
+    );
+    parser.option("runs n", "2000");
+    parser.option("bin", "bin");
+    parser.parse(argc, argv);
+
+    int runs = atoi(parser.value("runs").c_str());
+    string bin = parser.value("bin");
+    if (runs < 1) {
+        fprintf(stderr, "Error: --runs must be at least 1.\n");
+        exit(1);
+    }
+
+    vector<string> flat = {"--foo", "-f", "--bar", "value", "--opt-1=x", "abc", "def"};
+    vector<string> cmd = {"cmd-1", "--foo", "--bar", "value", "--opt-1=x", "abc", "def"};
+
+    vector<Variant> variants = {
+        {"baseline", {}},
+        {"ex1", {"--foo", "-f", "--bar", "value", "abc", "def"}},
+        {"ex2", {"boo", "-f", "--bar", "value", "abc"}},
+        {"bench_small", flat},
+        {"bench_medium", flat},
+        {"bench_large", flat},
+        {"bench_cmd_small", cmd},
+        {"bench_cmd_medium", cmd},
+        {"bench_cmd_large", cmd},
+    };
+
+    double baseline_p50 = 0;
+
+    printf("%-18s %10s %10s %10s %10s %10s\n",
+        "binary", "p50 (us)", "p99 (us)", "+p50 (us)", "minflt", "majflt");
+
+    for (Variant& variant: variants) {
+        string path = bin + "/" + (variant.name == "baseline" ? "bench_baseline" : variant.name);
+
+        vector<char*> exec_argv;
+        exec_argv.push_back(const_cast<char*>(path.c_str()));
+        for (string& arg: variant.argv) {
+            exec_argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        exec_argv.push_back(nullptr);
+
+        Result result;
+        for (int i = 0; i < runs; i++) {
+            result.micros.push_back(runOnce(exec_argv, result));
+        }
+
+        sort(result.micros.begin(), result.micros.end());
+        double p50 = percentile(result.micros, 0.50);
+        double p99 = percentile(result.micros, 0.99);
+        if (variant.name == "baseline") {
+            baseline_p50 = p50;
+        }
+
+        printf("%-18s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            variant.name.c_str(),
+            p50,
+            p99,
+            p50 - baseline_p50,
+            double(result.minflt) / runs,
+            double(result.majflt) / runs
+        );
+    }
+}
@@ -3,10 +3,21 @@
 // -----------------------------------------------------------------------------
 
 #include <cassert>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 #include <vector>
 #include <string>
 #include "args.h"
 
+#ifndef _WIN32
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
 using namespace std;
 using namespace args;
 
@@ -164,6 +175,1406 @@ void test_command() {
     printf(".");
 }
 
+// -----------------------------------------------------------------------------
+// 8. Reset.
+// -----------------------------------------------------------------------------
+
+void test_reset() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.parse(vector<string>({"-ff", "--bar", "baz", "abc"}));
+    parser.reset();
+    assert(parser.found("foo") == false);
+    assert(parser.count("bar") == 0);
+    assert(parser.value("bar") == "default");
+    assert(parser.args.size() == 0);
+    parser.parse(vector<string>({"-f", "def"}));
+    assert(parser.count("foo") == 1);
+    assert(parser.args.size() == 1);
+    assert(parser.args[0] == "def");
+    printf(".");
+}
+
+void test_reset_command() {
+    ArgParser parser;
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("foo");
+    parser.parse(vector<string>({"boo", "--foo", "abc"}));
+    parser.reset();
+    assert(parser.commandFound() == false);
+    assert(cmd_parser.found("foo") == false);
+    assert(cmd_parser.args.size() == 0);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 9. Move semantics.
+// -----------------------------------------------------------------------------
+
+ArgParser make_parser() {
+    ArgParser parser("helptext");
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.command("boo").flag("baz");
+    return parser;
+}
+
+void test_move_construct() {
+    ArgParser parser = make_parser();
+    parser.parse(vector<string>({"-f", "--bar", "bam", "boo", "--baz"}));
+    assert(parser.found("foo"));
+    assert(parser.value("bar") == "bam");
+    assert(parser.commandParser().found("baz"));
+    printf(".");
+}
+
+void test_move_assign() {
+    ArgParser source;
+    ArgParser& cmd_parser = source.command("boo");
+    cmd_parser.flag("baz");
+    ArgParser parser;
+    parser.flag("foo");
+    parser = std::move(source);
+    parser.parse(vector<string>({"boo", "--baz"}));
+    assert(parser.found("foo") == false);
+    assert(cmd_parser.found("baz"));
+    printf(".");
+}
+
+void test_take_args() {
+    ArgParser parser;
+    parser.parse(vector<string>({"abc", "def"}));
+    vector<string> args = parser.takeArgs();
+    assert(args.size() == 2);
+    assert(args[1] == "def");
+    assert(parser.args.size() == 0);
+    printf(".");
+}
+
+void test_take_values() {
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.parse(vector<string>({"--foo", "abc", "-f", "def"}));
+    vector<string> values = parser.takeValues("foo");
+    assert(values.size() == 2);
+    assert(values[0] == "abc");
+    assert(parser.found("foo") == false);
+    assert(parser.value("foo") == "default");
+    assert(parser.takeValues("nope").size() == 0);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 10. Const accessors.
+// -----------------------------------------------------------------------------
+
+void check_const_parser(ArgParser const& parser) {
+    for (int i = 0; i < 1000; i++) {
+        assert(parser.found("foo"));
+        assert(parser.count("foo") == 2);
+        assert(parser.found("nope") == false);
+        assert(parser.value("bar") == "baz");
+        assert(parser.values("bar").size() == 1);
+        assert(parser.commandFound());
+        assert(parser.commandName() == "boo");
+        assert(parser.commandParser().args.size() == 1);
+    }
+}
+
+void test_const_accessors_threaded() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.command("boo");
+    parser.parse(vector<string>({"-ff", "--bar", "baz", "boo", "abc"}));
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread(check_const_parser, std::cref(parser)));
+    }
+    for (thread& t: threads) {
+        t.join();
+    }
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 11. Live values.
+// -----------------------------------------------------------------------------
+
+void test_live_value() {
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.parse(vector<string>({"--foo", "bar"}));
+    assert(parser.liveValue("foo") == "bar");
+    assert(parser.setLiveValue("foo", "baz"));
+    assert(parser.liveValue("f") == "baz");
+    assert(parser.value("foo") == "bar");
+    assert(parser.setLiveValue("nope", "baz") == false);
+    assert(parser.liveValue("nope") == "");
+    printf(".");
+}
+
+void read_live_values(ArgParser const& parser) {
+    for (int i = 0; i < 10000; i++) {
+        string value = parser.liveValue("foo");
+        assert(value == "bar" || value.compare(0, 6, "value-") == 0);
+    }
+}
+
+void test_live_value_threaded() {
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.parse(vector<string>({"--foo", "bar"}));
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread(read_live_values, std::cref(parser)));
+    }
+    for (int i = 0; i < 1000; i++) {
+        parser.setLiveValue("foo", "value-" + to_string(i));
+    }
+    for (thread& t: threads) {
+        t.join();
+    }
+    assert(parser.liveValue("foo") == "value-999");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 12. Config files.
+// -----------------------------------------------------------------------------
+
+void write_file(char const* path, char const* content) {
+    FILE* file = fopen(path, "w");
+    assert(file != nullptr);
+    fputs(content, file);
+    fclose(file);
+}
+
+void test_config_values() {
+    write_file("args_test.cfg",
+        "# comment\n"
+        "\n"
+        "foo = yes\n"
+        "  bar=  from file  \n"
+        "b = \"quoted value\"\r\n"
+        "baz = 123");
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.option("baz", "default");
+    parser.option("bam", "default");
+    assert(parser.loadConfig("args_test.cfg"));
+    parser.parse(vector<string>());
+    assert(parser.found("foo"));
+    assert(parser.count("foo") == 1);
+    assert(parser.value("bar") == "quoted value");
+    assert(parser.value("baz") == "123");
+    assert(parser.values("baz").size() == 1);
+    assert(parser.found("bam") == false);
+    assert(parser.value("bam") == "default");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_config_override() {
+    write_file("args_test.cfg", "foo = true\nbar = file\n");
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    assert(parser.loadConfig("args_test.cfg"));
+    parser.parse(vector<string>({"-ff", "--bar", "cli"}));
+    assert(parser.count("foo") == 2);
+    assert(parser.value("bar") == "cli");
+    assert(parser.values("bar").size() == 1);
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_config_missing_file() {
+    ArgParser parser;
+    assert(parser.loadConfig("args_test_missing.cfg") == false);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 13. Environment variables.
+// -----------------------------------------------------------------------------
+
+void test_env_fallback() {
+    setenv("ARGS_TEST_FOO", "from env", 1);
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.option("bar b", "default");
+    assert(parser.env("foo", "ARGS_TEST_FOO"));
+    assert(parser.env("bar", "ARGS_TEST_UNSET"));
+    assert(parser.env("nope", "ARGS_TEST_FOO") == false);
+    parser.parse(vector<string>());
+    assert(parser.found("foo"));
+    assert(parser.value("foo") == "from env");
+    assert(parser.found("bar") == false);
+    assert(parser.value("bar") == "default");
+    unsetenv("ARGS_TEST_FOO");
+    printf(".");
+}
+
+void test_env_take_values() {
+    setenv("ARGS_TEST_FOO", "from env", 1);
+    write_file("args_test.cfg", "bar = from file\n");
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.option("bar b", "default");
+    parser.env("foo", "ARGS_TEST_FOO");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>());
+    assert(parser.takeValues("foo") == vector<string>({"from env"}));
+    assert(parser.takeValues("bar") == vector<string>({"from file"}));
+    assert(parser.found("foo") == false);
+    assert(parser.value("foo") == "default");
+    assert(parser.found("bar") == false);
+    assert(parser.value("bar") == "default");
+    assert(parser.values("bar").empty());
+
+    parser.reset();
+    parser.parse(vector<string>());
+    assert(parser.value("foo") == "from env");
+    assert(parser.value("bar") == "from file");
+    unsetenv("ARGS_TEST_FOO");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_env_precedence() {
+    setenv("ARGS_TEST_FOO", "from env", 1);
+    write_file("args_test.cfg", "foo = from file\nbar = from file\n");
+    ArgParser parser;
+    parser.option("foo f", "default");
+    parser.option("bar b", "default");
+    parser.env("foo", "ARGS_TEST_FOO");
+    parser.env("bar", "ARGS_TEST_FOO");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>({"--bar", "from cli"}));
+    assert(parser.value("foo") == "from env");
+    assert(parser.value("bar") == "from cli");
+    unsetenv("ARGS_TEST_FOO");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_env_command() {
+    setenv("ARGS_TEST_FOO", "from env", 1);
+    ArgParser parser;
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.option("foo", "default");
+    cmd_parser.env("foo", "ARGS_TEST_FOO");
+    parser.parse(vector<string>({"boo"}));
+    assert(cmd_parser.value("foo") == "from env");
+    parser.reset();
+    unsetenv("ARGS_TEST_FOO");
+    parser.parse(vector<string>({"boo"}));
+    assert(cmd_parser.value("foo") == "default");
+    printf(".");
+}
+
+void test_env_moved() {
+    setenv("ARGS_TEST_FOO", "from env", 1);
+    ArgParser parser;
+    parser.option("bar", "default");
+    parser.env("bar", "ARGS_TEST_FOO");
+    ArgParser& cmd_parser = parser.command("boo");
+    ArgParser moved(std::move(parser));
+    cmd_parser.option("foo", "default");
+    cmd_parser.env("foo", "ARGS_TEST_FOO");
+    moved.parse(vector<string>({"boo"}));
+    assert(moved.value("bar") == "from env");
+    assert(cmd_parser.value("foo") == "from env");
+    unsetenv("ARGS_TEST_FOO");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 14. Config reloading.
+// -----------------------------------------------------------------------------
+
+// Wait up to two seconds for the live value of [name] to become [expected].
+bool wait_for_live_value(ArgParser& parser, string const& name, string const& expected) {
+    for (int i = 0; i < 200; i++) {
+        if (parser.liveValue(name) == expected) {
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return false;
+}
+
+void test_config_reload() {
+    write_file("args_test.cfg", "foo = one\nbar = one\nbaz = one\n");
+    ArgParser parser;
+    parser.option("foo", "default");
+    parser.option("bar", "default");
+    parser.option("baz", "default");
+    parser.option("bam", "default");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>({"--bar", "cli"}));
+    write_file("args_test.cfg", "foo = two\nbar = two\nbam = two\n");
+    assert(parser.reloadConfig());
+    assert(parser.liveValue("foo") == "two");
+    assert(parser.liveValue("bar") == "cli");
+    assert(parser.liveValue("baz") == "default");
+    assert(parser.liveValue("bam") == "two");
+    assert(parser.value("foo") == "one");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_config_watch_sighup() {
+    write_file("args_test.cfg", "foo = one\n");
+    ArgParser parser;
+    parser.option("foo", "default");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>());
+    assert(parser.watchConfig());
+    write_file("args_test.cfg", "foo = two\n");
+    raise(SIGHUP);
+    assert(wait_for_live_value(parser, "foo", "two"));
+    parser.unwatchConfig();
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_config_watch_file() {
+    write_file("args_test.cfg", "foo = one\n");
+    ArgParser parser;
+    parser.option("foo", "default");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>());
+    assert(parser.watchConfig());
+    write_file("args_test.cfg", "foo = two\n");
+#ifdef __linux__
+    assert(wait_for_live_value(parser, "foo", "two"));
+#endif
+    remove("args_test.cfg");
+    printf(".");
+}
+
+// Stopping the last watcher restores the previous SIGHUP disposition.
+void test_config_watch_restores_sighup() {
+#ifndef _WIN32
+    write_file("args_test.cfg", "# empty\n");
+    struct sigaction before, during, after;
+    sigaction(SIGHUP, nullptr, &before);
+    ArgParser parser1, parser2;
+    parser1.loadConfig("args_test.cfg");
+    parser2.loadConfig("args_test.cfg");
+    assert(parser1.watchConfig());
+    assert(parser2.watchConfig());
+    parser1.unwatchConfig();
+    sigaction(SIGHUP, nullptr, &during);
+    assert(during.sa_handler != before.sa_handler);
+    parser2.unwatchConfig();
+    sigaction(SIGHUP, nullptr, &after);
+    assert(after.sa_handler == before.sa_handler);
+    remove("args_test.cfg");
+#endif
+    printf(".");
+}
+
+// Recreating the file mustn't publish the fallbacks while it's still empty.
+void test_config_watch_recreate() {
+    write_file("args_test.cfg", "foo = one\n");
+    ArgParser parser;
+    parser.option("foo", "default");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>());
+    assert(parser.watchConfig());
+    remove("args_test.cfg");
+    FILE* file = fopen("args_test.cfg", "w");
+    assert(file != nullptr);
+    auto start = chrono::steady_clock::now();
+    while (chrono::steady_clock::now() - start < chrono::milliseconds(100)) {
+        assert(parser.liveValue("foo") != "default");
+    }
+    fputs("foo = two\n", file);
+    fclose(file);
+#ifdef __linux__
+    assert(wait_for_live_value(parser, "foo", "two"));
+#endif
+    parser.unwatchConfig();
+    remove("args_test.cfg");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 15. Snapshots.
+// -----------------------------------------------------------------------------
+
+void test_snapshot_buffer() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.flag("bam");
+    parser.option("bar b", "default");
+    parser.option("baz", "fallback");
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("foo f");
+    cmd_parser.option("bar", "default");
+    parser.parse(vector<string>({"-ff", "--bar", "x", "-b", "y", "boo", "--bar=z", "def"}));
+
+    string buffer = parser.snapshot();
+    Snapshot snapshot(buffer.data(), buffer.size());
+    assert(snapshot.valid());
+    assert(snapshot.count("foo") == 2);
+    assert(snapshot.count("f") == 2);
+    assert(snapshot.found("bam") == false);
+    assert(snapshot.found("nope") == false);
+    assert(snapshot.value("bar") == "y");
+    assert(snapshot.value("b") == "y");
+    assert(snapshot.values("bar") == parser.values("bar"));
+    assert(snapshot.value("baz") == "fallback");
+    assert(snapshot.values("baz").empty());
+    assert(snapshot.args() == parser.args);
+    assert(snapshot.commandFound());
+    assert(snapshot.commandName() == "boo");
+    Snapshot cmd_snapshot = snapshot.commandParser();
+    assert(cmd_snapshot.value("bar") == "z");
+    assert(cmd_snapshot.args() == cmd_parser.args);
+    assert(cmd_snapshot.commandFound() == false);
+    printf(".");
+}
+
+// Aliases share their option's record, so values are written once.
+void test_snapshot_aliases() {
+    ArgParser parser;
+    parser.option("foo f F fo");
+    vector<string> input;
+    for (int i = 0; i < 1000; i++) {
+        input.push_back("-f");
+        input.push_back(string(96, 'x') + to_string(1000 + i));
+    }
+    parser.parse(input);
+    string buffer = parser.snapshot();
+    assert(buffer.size() < 120000);
+    Snapshot snapshot(buffer.data(), buffer.size());
+    assert(snapshot.values("fo") == parser.values("foo"));
+    assert(snapshot.value("F") == parser.value("foo"));
+    assert(snapshot.count("f") == 1000);
+    printf(".");
+}
+
+void test_snapshot_file() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.parse(vector<string>({"-f", "abc"}));
+    assert(parser.saveSnapshot("args_test.snap"));
+
+    Snapshot snapshot;
+    assert(snapshot.load("args_test.snap"));
+    assert(snapshot.found("foo"));
+    assert(snapshot.value("bar") == "default");
+    assert(snapshot.args() == vector<string>({"abc"}));
+    assert(snapshot.commandFound() == false);
+    remove("args_test.snap");
+    printf(".");
+}
+
+void test_snapshot_invalid() {
+    string garbage = "not a snapshot";
+    Snapshot snapshot(garbage.data(), garbage.size());
+    assert(snapshot.valid() == false);
+    assert(snapshot.found("foo") == false);
+    assert(snapshot.args().empty());
+
+    ArgParser parser;
+    parser.option("bar", "default");
+    parser.parse(vector<string>({"abc"}));
+    string buffer = parser.snapshot();
+    Snapshot truncated(buffer.data(), buffer.size() - 4);
+    assert(truncated.valid() == false);
+    assert(snapshot.load("args_test_missing.snap") == false);
+
+    // A command offset which doesn't point past its parent's node is ignored.
+    parser.command("boo");
+    parser.reset();
+    parser.parse(vector<string>({"boo"}));
+    buffer = parser.snapshot();
+    uint32_t root;
+    memcpy(&root, &buffer[12], sizeof(root));
+    memcpy(&buffer[root + 8], &root, sizeof(root));
+    Snapshot looped(buffer.data(), buffer.size());
+    assert(looped.commandFound() == false);
+    assert(looped.errors().empty());
+    uint32_t past = uint32_t(buffer.size());
+    memcpy(&buffer[root + 8], &past, sizeof(past));
+    Snapshot overrun(buffer.data(), buffer.size());
+    assert(overrun.commandFound() == false);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 16. Canonical hashing.
+// -----------------------------------------------------------------------------
+
+uint64_t canonical_hash(vector<string> const& input, bool values_ordered = true, bool args_ordered = true) {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.flag("verbose v");
+    parser.option("bar b", "default");
+    ArgParser& cmd_parser = parser.command("boo b2");
+    cmd_parser.flag("foo f");
+    parser.setHashOrder(values_ordered, args_ordered);
+    parser.parse(input);
+    return parser.canonicalHash();
+}
+
+void test_hash_spelling() {
+    uint64_t hash = canonical_hash({"-fv", "--bar=x", "abc"});
+    assert(canonical_hash({"-f", "-v", "-b", "x", "abc"}) == hash);
+    assert(canonical_hash({"--verbose", "--bar", "x", "--foo", "abc"}) == hash);
+    assert(canonical_hash({"abc", "-b=x", "-vf"}) == hash);
+    assert(canonical_hash({"-fv", "--bar=y", "abc"}) != hash);
+    assert(canonical_hash({"-ffv", "--bar=x", "abc"}) != hash);
+    assert(canonical_hash({"-fv", "abc"}) != hash);
+    assert(canonical_hash({"-fv", "--bar=x", "abc", "def"}) != hash);
+    printf(".");
+}
+
+void test_hash_order() {
+    assert(canonical_hash({"-b", "x", "-b", "y"}) != canonical_hash({"-b", "y", "-b", "x"}));
+    assert(canonical_hash({"-b", "x", "-b", "y"}, false) == canonical_hash({"-b", "y", "-b", "x"}, false));
+    assert(canonical_hash({"-b", "x", "-b", "y"}, false) != canonical_hash({"-b", "x", "-b", "x"}, false));
+    assert(canonical_hash({"abc", "def"}) != canonical_hash({"def", "abc"}));
+    assert(canonical_hash({"abc", "def"}, true, false) == canonical_hash({"def", "abc"}, true, false));
+    printf(".");
+}
+
+void test_hash_command() {
+    uint64_t hash = canonical_hash({"boo", "-f", "abc"});
+    assert(canonical_hash({"b2", "--foo", "abc"}) == hash);
+    assert(canonical_hash({"-f", "abc"}) != hash);
+    assert(canonical_hash({"boo", "abc"}) != hash);
+    printf(".");
+}
+
+void test_hash_reset() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    uint64_t empty = parser.canonicalHash();
+    parser.parse(vector<string>({"-f", "-b", "x", "abc"}));
+    uint64_t hash = parser.canonicalHash();
+    parser.reset();
+    assert(parser.canonicalHash() == empty);
+    parser.parse(vector<string>({"-f", "-b", "x", "abc"}));
+    assert(parser.canonicalHash() == hash);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 17. Parse cache.
+// -----------------------------------------------------------------------------
+
+void test_cache_hits() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.option("bar b", "default");
+    ParseCache cache(parser, 1 << 20);
+
+    auto first = cache.parse(vector<string>({"-f", "--bar", "x", "abc"}));
+    auto second = cache.parse(vector<string>({"boo", "-b", "y"}));
+    auto third = cache.parse(vector<string>({"-f", "--bar", "x", "abc"}));
+    assert(cache.hits() == 1);
+    assert(cache.misses() == 2);
+    assert(cache.size() == 2);
+    assert(first == third);
+    assert(first->found("foo"));
+    assert(first->value("bar") == "x");
+    assert(first->args() == vector<string>({"abc"}));
+    assert(second->commandName() == "boo");
+    assert(second->commandParser().value("bar") == "y");
+    assert(second->found("foo") == false);
+    printf(".");
+}
+
+void test_cache_errors() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.flag("foo");
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("bar");
+    ParseCache cache(parser, 1 << 20);
+
+    auto first = cache.parse(vector<string>({"--nope", "boo", "--baz"}));
+    auto second = cache.parse(vector<string>({"--nope", "boo", "--baz"}));
+    auto valid = cache.parse(vector<string>({"--foo"}));
+    assert(cache.hits() == 1);
+    assert(second->errors() == vector<string>({
+        "--nope is not a recognised flag or option.",
+        "--baz is not a recognised flag or option. Did you mean --bar?",
+    }));
+    assert(second->commandParser().errors().size() == 1);
+    assert(valid->errors().empty());
+    printf(".");
+}
+
+void test_cache_keys() {
+    ArgParser parser;
+    ParseCache cache(parser, 1 << 20);
+    auto first = cache.parse(vector<string>({"ab", "c"}));
+    auto second = cache.parse(vector<string>({"a", "bc"}));
+    assert(cache.misses() == 2);
+    assert(first->args() == vector<string>({"ab", "c"}));
+    assert(second->args() == vector<string>({"a", "bc"}));
+    printf(".");
+}
+
+void test_cache_eviction() {
+    ArgParser parser;
+    parser.option("bar b", "default");
+    ParseCache cache(parser, 2048);
+    auto held = cache.parse(vector<string>({"--bar", "held"}));
+    for (int i = 0; i < 100; i++) {
+        cache.parse(vector<string>({"--bar", to_string(i)}));
+    }
+    assert(cache.size() > 0);
+    assert(cache.size() < 100);
+    assert(held->value("bar") == "held");
+    cache.parse(vector<string>({"--bar", "99"}));
+    assert(cache.hits() == 1);
+    cache.parse(vector<string>({"--bar", "held"}));
+    assert(cache.hits() == 1);
+    cache.clear();
+    assert(cache.size() == 0);
+    assert(held->value("bar") == "held");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 18. Incremental parsing.
+// -----------------------------------------------------------------------------
+
+void test_feed_options() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.option("baz z", "default");
+    parser.feed("--bar");
+    assert(parser.value("bar") == "default");
+    parser.feed("x");
+    assert(parser.value("bar") == "x");
+    parser.feed("-fbzf");
+    assert(parser.count("foo") == 1);
+    parser.feed("y");
+    assert(parser.value("bar") == "y");
+    assert(parser.count("foo") == 1);
+    parser.feed("z");
+    assert(parser.value("baz") == "z");
+    assert(parser.count("foo") == 2);
+    parser.feed("abc");
+    parser.finish();
+    assert(parser.args == vector<string>({"abc"}));
+    printf(".");
+}
+
+void test_feed_dashdash() {
+    ArgParser parser;
+    parser.flag("foo f");
+    parser.feed("abc");
+    parser.feed("--");
+    parser.feed("-f");
+    parser.feed("--foo");
+    parser.finish();
+    assert(parser.found("foo") == false);
+    assert(parser.args == vector<string>({"abc", "-f", "--foo"}));
+    printf(".");
+}
+
+static int feed_callback_count = 0;
+
+void feed_callback(string cmd_name, ArgParser& cmd_parser) {
+    assert(cmd_name == "boo");
+    assert(cmd_parser.value("bar") == "y");
+    feed_callback_count++;
+}
+
+void test_feed_command() {
+    ArgParser parser;
+    parser.flag("foo f");
+    ArgParser& cmd_parser = parser.command("boo", "", feed_callback);
+    cmd_parser.option("bar b", "default");
+    parser.feed("-f");
+    parser.feed("boo");
+    assert(parser.commandFound());
+    parser.feed("--bar");
+    parser.feed("y");
+    parser.feed("abc");
+    assert(feed_callback_count == 0);
+    parser.finish();
+    assert(feed_callback_count == 1);
+    assert(parser.found("foo"));
+    assert(parser.args.empty());
+    assert(cmd_parser.args == vector<string>({"abc"}));
+
+    parser.reset();
+    parser.parse(vector<string>({"boo", "-b", "y"}));
+    assert(feed_callback_count == 2);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 19. Collecting errors.
+// -----------------------------------------------------------------------------
+
+void test_collect_errors() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.flag("foo f");
+    parser.option("bar b", "default");
+    parser.option("baz", "default");
+    parser.parse(vector<string>({"--nope", "-fxf", "abc", "--baz=", "--bat=x", "--baz", "y", "--bar"}));
+    vector<string> errors = parser.errors();
+    assert(errors.size() == 5);
+    assert(errors[0] == "--nope is not a recognised flag or option.");
+    assert(errors[1] == "'x' in -fxf is not a recognised flag or option.");
+    assert(errors[2] == "missing value for --baz.");
+    assert(errors[3] == "--bat is not a recognised option. Did you mean --bar or --baz?");
+    assert(errors[4] == "missing argument for --bar.");
+    assert(parser.count("foo") == 2);
+    assert(parser.value("baz") == "y");
+    assert(parser.args == vector<string>({"abc"}));
+
+    parser.reset();
+    parser.parse(vector<string>({"-f"}));
+    assert(parser.errors().empty());
+    printf(".");
+}
+
+static int collect_callback_count = 0;
+
+void collect_callback(string cmd_name, ArgParser& cmd_parser) {
+    collect_callback_count++;
+}
+
+void test_collect_errors_command() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    ArgParser& cmd_parser = parser.command("boo", "", collect_callback);
+    cmd_parser.flag("foo");
+    parser.parse(vector<string>({"boo", "--fo", "--foo"}));
+    assert(parser.errors() == vector<string>({"--fo is not a recognised flag or option. Did you mean --foo?"}));
+    assert(cmd_parser.found("foo"));
+    assert(collect_callback_count == 0);
+
+    parser.reset();
+    parser.parse(vector<string>({"help", "bo"}));
+    assert(parser.errors() == vector<string>({"'bo' is not a recognised command. Did you mean 'boo'?"}));
+
+    parser.reset();
+    parser.parse(vector<string>({"help"}));
+    assert(parser.errors() == vector<string>({"the help command requires an argument."}));
+
+    parser.reset();
+    parser.parse(vector<string>({"boo", "--foo"}));
+    assert(parser.errors().empty());
+    assert(collect_callback_count == 1);
+    printf(".");
+}
+
+// Help and version requests are recorded rather than exiting, so a batch of
+// command lines can be checked in one process.
+void test_collect_errors_help() {
+    ArgParser parser("Usage: app", "1.0");
+    parser.setCollectErrors(true);
+    parser.option("output o", "default");
+    parser.require("output");
+    ArgParser& cmd_parser = parser.command("boo", "Usage: app boo", collect_callback);
+    cmd_parser.flag("foo");
+    int callbacks = collect_callback_count;
+
+    vector<vector<string>> batch({
+        {"--help"}, {"-h", "--nope"}, {"--version"}, {"-v"},
+        {"help", "boo"}, {"boo", "--help"}, {"boo", "-h", "--foo"},
+    });
+    for (vector<string> const& input: batch) {
+        parser.reset();
+        parser.parse(input);
+        bool version = input[0] == "--version" || input[0] == "-v";
+        assert(parser.helpRequested() == !version);
+        assert(parser.versionRequested() == version);
+    }
+    assert(parser.errors().empty());
+    assert(cmd_parser.found("foo"));
+    assert(collect_callback_count == callbacks);
+
+    parser.reset();
+    parser.parse(vector<string>({"-h", "--nope"}));
+    assert(parser.errors() == vector<string>({"--nope is not a recognised flag or option."}));
+
+    parser.reset();
+    parser.parse(vector<string>({"-o", "x", "boo"}));
+    assert(parser.helpRequested() == false);
+    assert(parser.versionRequested() == false);
+    assert(collect_callback_count == callbacks + 1);
+
+    ParseCache cache(parser, 1 << 20);
+    auto result = cache.parse(vector<string>({"boo", "--help"}));
+    assert(result->helpRequested());
+    assert(result->versionRequested() == false);
+    assert(result->commandParser().helpRequested());
+    result = cache.parse(vector<string>({"--version"}));
+    assert(result->versionRequested());
+    result = cache.parse(vector<string>({"-o", "x"}));
+    assert(result->helpRequested() == false);
+    assert(collect_callback_count == callbacks + 1);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 20. Constraints.
+// -----------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+// Run parse() in a child process and return what it prints to stderr.
+string parse_errors(ArgParser& parser, vector<string> const& input) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        dup2(fds[1], 2);
+        parser.parse(input);
+        _exit(0);
+    }
+    close(fds[1]);
+    string output;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, count);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return output;
+}
+
+#endif
+
+void test_constraints() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.flag("json j");
+    parser.flag("yaml y");
+    parser.flag("xml");
+    parser.option("output o", "default");
+    parser.option("format", "default");
+    parser.option("level", "default");
+    assert(parser.require("output"));
+    assert(parser.exclusive("json yaml xml"));
+    assert(parser.depends("level", "format"));
+    assert(parser.require("nope") == false);
+    assert(parser.exclusive("json nope") == false);
+    assert(parser.depends("level", "nope") == false);
+
+    parser.parse(vector<string>({"-o", "x", "--json"}));
+    assert(parser.errors().empty());
+
+    parser.reset();
+    parser.parse(vector<string>({"-jy", "--xml", "--level", "3"}));
+    vector<string> errors = parser.errors();
+    assert(errors.size() == 3);
+    assert(errors[0] == "--output is required.");
+    assert(errors[1] == "--json, --yaml, --xml can't be used together.");
+    assert(errors[2] == "--level requires --format.");
+
+    parser.reset();
+    parser.parse(vector<string>({"-o", "x", "--level", "3", "--format", "y"}));
+    assert(parser.errors().empty());
+    printf(".");
+}
+
+void constraint_callback(string cmd_name, ArgParser& cmd_parser) {
+    fputs("callback ran\n", stderr);
+}
+
+// A command's callback only runs if the parent's constraints are satisfied.
+void test_constraints_callback() {
+#ifndef _WIN32
+    ArgParser parser;
+    parser.option("output o", "default");
+    parser.require("output");
+    ArgParser& cmd_parser = parser.command("boo", "", constraint_callback);
+    cmd_parser.command("bam", "", constraint_callback);
+    assert(parse_errors(parser, {"boo"}) == "Error: --output is required.\n");
+    assert(parse_errors(parser, {"boo", "bam"}) == "Error: --output is required.\n");
+    assert(parse_errors(parser, {"-o", "x", "boo", "bam"}) == "callback ran\ncallback ran\n");
+#endif
+    printf(".");
+}
+
+void test_constraints_many() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    for (int i = 0; i < 200; i++) {
+        parser.flag("flag-" + to_string(i));
+        parser.require("flag-" + to_string(i));
+    }
+    parser.exclusive("flag-3 flag-150");
+    parser.parse(vector<string>({"--flag-3", "--flag-150"}));
+    vector<string> errors = parser.errors();
+    assert(errors.size() == 199);
+    assert(errors[0] == "--flag-0 is required.");
+    assert(errors[197] == "--flag-199 is required.");
+    assert(errors[198] == "--flag-3, --flag-150 can't be used together.");
+    printf(".");
+}
+
+// A group needs at least two names; with no earlier constraint the parser
+// has no constraint set yet.
+void test_constraints_short_group() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.flag("a");
+    assert(parser.exclusive("") == false);
+    assert(parser.exclusive("  ") == false);
+    assert(parser.exclusive("a") == false);
+    parser.parse(vector<string>({"-a"}));
+    assert(parser.errors().empty());
+    printf(".");
+}
+
+void test_constraints_config() {
+    write_file("args_test.cfg", "output = x\n");
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.option("output o", "default");
+    parser.require("output");
+    parser.loadConfig("args_test.cfg");
+    parser.parse(vector<string>());
+    assert(parser.errors().empty());
+    remove("args_test.cfg");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 21. Choice options.
+// -----------------------------------------------------------------------------
+
+void test_choice() {
+    ArgParser parser;
+    parser.choice("mode m", "fast safe debug", "safe");
+    parser.choice("level", "low high");
+    parser.option("other", "x");
+    assert(parser.choiceIndex("mode") == 1);
+    assert(parser.choiceIndex("level") == -1);
+    assert(parser.choiceIndex("other") == -1);
+    assert(parser.choiceIndex("nope") == -1);
+
+    parser.parse(vector<string>({"--mode", "debug", "--level=high"}));
+    assert(parser.value("mode") == "debug");
+    assert(parser.choiceIndex("mode") == 2);
+    assert(parser.choiceIndex("m") == 2);
+    assert(parser.choiceIndex("level") == 1);
+
+    parser.reset();
+    parser.parse(vector<string>({"-m", "fast"}));
+    assert(parser.choiceIndex("mode") == 0);
+    assert(parser.choiceIndex("level") == -1);
+    printf(".");
+}
+
+void test_choice_invalid() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.choice("mode m", "fast safe debug", "safe");
+    parser.parse(vector<string>({"--mode", "fast", "-m", "turbo"}));
+    assert(parser.errors() == vector<string>({"invalid value 'turbo' for --mode: expected fast, safe or debug."}));
+    assert(parser.value("mode") == "fast");
+    assert(parser.choiceIndex("mode") == 0);
+    printf(".");
+}
+
+void test_choice_many() {
+    string choices;
+    for (int i = 0; i < 3000; i++) {
+        choices += "choice-" + to_string(i) + " ";
+    }
+    ArgParser parser;
+    parser.choice("pick", choices);
+    for (int i = 0; i < 3000; i += 7) {
+        parser.reset();
+        parser.parse(vector<string>({"--pick", "choice-" + to_string(i)}));
+        assert(parser.choiceIndex("pick") == i);
+    }
+
+    ArgParser duplicates;
+    duplicates.choice("pick", "a b a c b");
+    duplicates.parse(vector<string>({"--pick", "b"}));
+    assert(duplicates.choiceIndex("pick") == 1);
+    printf(".");
+}
+
+void test_choice_env_config() {
+    write_file("args_test.cfg", "mode = debug\n");
+    ArgParser parser;
+    parser.choice("mode", "fast safe debug", "safe");
+    parser.env("mode", "ARGS_TEST_MODE");
+    parser.loadConfig("args_test.cfg");
+    unsetenv("ARGS_TEST_MODE");
+    parser.parse(vector<string>());
+    assert(parser.choiceIndex("mode") == 2);
+    setenv("ARGS_TEST_MODE", "fast", 1);
+    parser.reset();
+    parser.parse(vector<string>());
+    assert(parser.choiceIndex("mode") == 0);
+
+    // An invalid value from the environment is reported and ignored.
+    setenv("ARGS_TEST_MODE", "turbo", 1);
+    parser.setCollectErrors(true);
+    parser.reset();
+    parser.parse(vector<string>());
+    assert(parser.errors() == vector<string>({
+        "invalid value 'turbo' for --mode from $ARGS_TEST_MODE: expected fast, safe or debug."}));
+    assert(parser.value("mode") == "debug");
+    assert(parser.choiceIndex("mode") == 2);
+    unsetenv("ARGS_TEST_MODE");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 22. Abbreviations.
+// -----------------------------------------------------------------------------
+
+void test_abbrev_options() {
+    ArgParser parser;
+    parser.setAbbreviations(true);
+    parser.flag("verbose verbosely v");
+    parser.flag("version-check");
+    parser.option("output o", "default");
+    parser.option("outline", "default");
+    parser.parse(vector<string>({"--verb", "--verbose", "--version-c", "--outp", "x", "--outl=y"}));
+    assert(parser.count("verbose") == 2);
+    assert(parser.found("version-check"));
+    assert(parser.value("output") == "x");
+    assert(parser.value("outline") == "y");
+    printf(".");
+}
+
+// A '--name=value' abbreviation can only expand to an option.
+void test_abbrev_equals() {
+    ArgParser parser;
+    parser.setAbbreviations(true);
+    parser.setCollectErrors(true);
+    parser.flag("verbose");
+    parser.option("verdict", "default");
+    parser.parse(vector<string>({"--ver=guilty", "--verb=x"}));
+    assert(parser.value("verdict") == "guilty");
+    assert(parser.found("verbose") == false);
+    assert(parser.errors().size() == 1);
+    assert(parser.errors()[0].find("--verb is not a recognised option.") == 0);
+
+    // An exact flag name isn't expanded to a longer option name.
+    ArgParser exact;
+    exact.setAbbreviations(true);
+    exact.setCollectErrors(true);
+    exact.flag("verbose");
+    exact.option("verbose-level", "default");
+    exact.parse(vector<string>({"--verbose=3"}));
+    assert(exact.value("verbose-level") == "default");
+    assert(exact.errors() == vector<string>({"--verbose is a flag and takes no value."}));
+    printf(".");
+}
+
+void test_abbrev_commands() {
+    ArgParser parser;
+    parser.setAbbreviations(true);
+    ArgParser& cmd_parser = parser.command("status st");
+    cmd_parser.flag("verbose");
+    parser.command("stash");
+    parser.parse(vector<string>({"stat", "--verb", "abc"}));
+    assert(parser.commandName() == "status");
+    assert(cmd_parser.found("verbose"));
+    assert(cmd_parser.args == vector<string>({"abc"}));
+
+    parser.reset();
+    parser.parse(vector<string>({"st"}));
+    assert(parser.commandName() == "st");
+
+    parser.reset();
+    parser.parse(vector<string>({"xyz"}));
+    assert(parser.commandFound() == false);
+    assert(parser.args == vector<string>({"xyz"}));
+    printf(".");
+}
+
+void test_abbrev_disabled() {
+    ArgParser parser;
+    parser.option("output", "default");
+    parser.command("status");
+    parser.parse(vector<string>({"stat"}));
+    assert(parser.commandFound() == false);
+    printf(".");
+}
+
+// -----------------------------------------------------------------------------
+// 23. Shell completion.
+// -----------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+// Run parse() in a child process with ARGS_COMPLETE set to [line] and return
+// what it prints.
+string complete(ArgParser& parser, string const& line) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        dup2(fds[1], 1);
+        setenv("ARGS_COMPLETE", line.c_str(), 1);
+        char arg0[] = "app";
+        char* argv[] = {arg0, nullptr};
+        parser.parse(1, argv);
+        _exit(1);
+    }
+    close(fds[1]);
+    string output;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, count);
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return output;
+}
+
+void test_completion() {
+    ArgParser parser("helptext");
+    parser.flag("foo f");
+    parser.flag("force");
+    parser.option("bar b", "default");
+    ArgParser& cmd_parser = parser.command("boo");
+    cmd_parser.flag("verbose v");
+    parser.command("bam");
+
+    assert(complete(parser, "app --f") == "--foo\n--force\n");
+    assert(complete(parser, "app --") == "--foo\n--force\n--bar\n--help\n");
+    assert(complete(parser, "app -") == "-f\n-b\n--foo\n--force\n--bar\n");
+    assert(complete(parser, "app ") == "bam\nboo\nhelp\n");
+    assert(complete(parser, "app -f b") == "bam\nboo\n");
+    assert(complete(parser, "app abc b") == "");
+    assert(complete(parser, "app --bar ") == "");
+    assert(complete(parser, "app -fb b") == "");
+    assert(complete(parser, "app help b") == "bam\nboo\n");
+    assert(complete(parser, "app boo --v") == "--verbose\n");
+    assert(complete(parser, "app -- --f") == "");
+    printf(".");
+}
+
+#else
+
+void test_completion() {
+    printf(".");
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// 24. Suggestions.
+// -----------------------------------------------------------------------------
+
+#ifndef _WIN32
+
+void test_suggestions() {
+    ArgParser parser;
+    parser.flag("verbose v");
+    parser.flag("version-check");
+    parser.option("output o", "default");
+    parser.command("status");
+    parser.command("stash");
+
+    assert(parse_errors(parser, {"--verbos"})
+        == "Error: --verbos is not a recognised flag or option. Did you mean --verbose?\n");
+    assert(parse_errors(parser, {"--outptu=x"})
+        == "Error: --outptu is not a recognised option. Did you mean --output?\n");
+    assert(parse_errors(parser, {"help", "stas"})
+        == "Error: 'stas' is not a recognised command. Did you mean 'stash'?\n");
+    assert(parse_errors(parser, {"help", "stsh"})
+        == "Error: 'stsh' is not a recognised command. Did you mean 'stash'?\n");
+    assert(parse_errors(parser, {"--xyzzy"})
+        == "Error: --xyzzy is not a recognised flag or option.\n");
+    assert(parse_errors(parser, {"--verbose=1"})
+        == "Error: --verbose is a flag and takes no value.\n");
+    assert(parse_errors(parser, {"-v=1"})
+        == "Error: -v is a flag and takes no value.\n");
+    assert(parse_errors(parser, {"--verbos=1"})
+        == "Error: --verbos is not a recognised option.\n");
+    printf(".");
+}
+
+void test_suggestions_many() {
+    ArgParser parser;
+    for (int i = 0; i < 20000; i++) {
+        parser.flag("flag-number-" + to_string(i));
+    }
+    assert(parse_errors(parser, {"--flag-numbr-1234"})
+        == "Error: --flag-numbr-1234 is not a recognised flag or option. Did you mean --flag-number-1234?\n");
+    printf(".");
+}
+
+#else
+
+void test_suggestions() {
+    printf(".");
+}
+
+void test_suggestions_many() {
+    printf(".");
+}
+
+#endif
+
+// -----------------------------------------------------------------------------
+// 25. Map options.
+// -----------------------------------------------------------------------------
+
+void test_map_option() {
+    ArgParser parser;
+    parser.mapOption("define D");
+    parser.option("other", "x");
+    parser.parse(vector<string>({"-D", "a=1", "--define=b.c=x=y", "-D", "a=2", "-D", "empty="}));
+    assert(parser.lookup("define", "a") == "2");
+    assert(parser.lookup("D", "b.c") == "x=y");
+    assert(parser.lookup("define", "empty") == "");
+    assert(parser.hasKey("define", "empty"));
+    assert(!parser.hasKey("define", "missing"));
+    assert(parser.lookup("define", "missing") == "");
+    assert(parser.lookup("other", "a") == "");
+    assert(parser.count("define") == 4);
+    assert(parser.value("define") == "empty=");
+
+    parser.reset();
+    parser.parse(vector<string>({"-D", "c=3"}));
+    assert(!parser.hasKey("define", "a"));
+    assert(parser.lookup("define", "c") == "3");
+    parser.takeValues("define");
+    assert(!parser.hasKey("define", "c"));
+    printf(".");
+}
+
+void test_map_option_invalid() {
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.mapOption("define D");
+    parser.parse(vector<string>({"-D", "a=1", "-D", "novalue", "-D", "=x"}));
+    assert(parser.errors() == vector<string>({
+        "invalid value 'novalue' for --define: expected key=value.",
+        "invalid value '=x' for --define: expected key=value.",
+    }));
+    assert(parser.count("define") == 1);
+    assert(parser.lookup("define", "a") == "1");
+    printf(".");
+}
+
+void test_map_option_many() {
+    ArgParser parser;
+    parser.mapOption("set");
+    vector<string> input;
+    for (int i = 0; i < 500; i++) {
+        input.push_back("--set");
+        input.push_back("key." + to_string(i % 200) + "=" + to_string(i));
+    }
+    parser.parse(input);
+    for (int i = 0; i < 200; i++) {
+        int last = i + 400 < 500 ? i + 400 : i + 200;
+        assert(parser.lookup("set", "key." + to_string(i)) == to_string(last));
+    }
+    printf(".");
+}
+
+void test_map_option_env_config() {
+    write_file("args_test.cfg", "define = a=cfg\n");
+    ArgParser parser;
+    parser.setCollectErrors(true);
+    parser.mapOption("define D");
+    parser.env("define", "ARGS_TEST_DEFINE");
+    parser.loadConfig("args_test.cfg");
+    unsetenv("ARGS_TEST_DEFINE");
+    parser.parse(vector<string>());
+    assert(parser.lookup("define", "a") == "cfg");
+    setenv("ARGS_TEST_DEFINE", "b=env=x", 1);
+    parser.reset();
+    parser.parse(vector<string>());
+    assert(parser.value("define") == "b=env=x");
+    assert(parser.lookup("define", "b") == "env=x");
+    assert(!parser.hasKey("define", "a"));
+    parser.reset();
+    parser.parse(vector<string>({"-D", "c=1"}));
+    assert(parser.lookup("define", "c") == "1");
+    assert(!parser.hasKey("define", "b"));
+
+    // An invalid value from the environment is reported and ignored.
+    setenv("ARGS_TEST_DEFINE", "novalue", 1);
+    parser.reset();
+    parser.parse(vector<string>());
+    assert(parser.errors() == vector<string>({
+        "invalid value 'novalue' for --define from $ARGS_TEST_DEFINE: expected key=value."}));
+    assert(parser.lookup("define", "a") == "cfg");
+    unsetenv("ARGS_TEST_DEFINE");
+    remove("args_test.cfg");
+    printf(".");
+}
+
+void test_map_option_snapshot() {
+    ArgParser parser;
+    parser.mapOption("define D");
+    parser.choice("mode", "fast safe debug", "safe");
+    parser.option("other", "x");
+    vector<string> input({"-D", "a=1", "--define=b.c=x=y", "-D", "a=2", "-D", "empty=", "--mode", "debug"});
+    for (int i = 0; i < 100; i++) {
+        input.push_back("-D");
+        input.push_back("key." + to_string(i) + "=" + to_string(i));
+    }
+    parser.parse(input);
+    string buffer = parser.snapshot();
+    Snapshot snapshot(buffer.data(), buffer.size());
+    assert(snapshot.lookup("D", "a") == "2");
+    assert(snapshot.lookup("define", "b.c") == "x=y");
+    assert(snapshot.hasKey("define", "empty"));
+    assert(!snapshot.hasKey("define", "missing"));
+    assert(snapshot.lookup("define", "key.42") == "42");
+    assert(snapshot.lookup("other", "a") == "");
+    assert(snapshot.lookup("nope", "a") == "");
+    assert(snapshot.choiceIndex("mode") == 2);
+    assert(snapshot.choiceIndex("other") == -1);
+    assert(snapshot.choiceIndex("nope") == -1);
+
+    // A fallback value is indexed like a command line one.
+    ArgParser fallback;
+    fallback.mapOption("define");
+    fallback.choice("mode", "fast safe debug", "safe");
+    ParseCache cache(fallback, 1 << 20);
+    setenv("ARGS_TEST_DEFINE", "a=env", 1);
+    fallback.env("define", "ARGS_TEST_DEFINE");
+    auto result = cache.parse(vector<string>());
+    assert(result->lookup("define", "a") == "env");
+    assert(result->choiceIndex("mode") == 1);
+    result = cache.parse(vector<string>({"--define", "b=1", "--mode", "fast"}));
+    assert(!result->hasKey("define", "a"));
+    assert(result->lookup("define", "b") == "1");
+    assert(result->choiceIndex("mode") == 0);
+    unsetenv("ARGS_TEST_DEFINE");
+    printf(".");
+}
+
 // -----------------------------------------------------------------------------
 // Test runner.
 // -----------------------------------------------------------------------------
@@ -203,6 +1614,103 @@ int main() {
     printf(" 5 ");
     test_command();
 
+    printf(" 6 ");
+    test_reset();
+    test_reset_command();
+
+    printf(" 7 ");
+    test_move_construct();
+    test_move_assign();
+    test_take_args();
+    test_take_values();
+
+    printf(" 8 ");
+    test_const_accessors_threaded();
+
+    printf(" 9 ");
+    test_live_value();
+    test_live_value_threaded();
+
+    printf(" 10 ");
+    test_config_values();
+    test_config_override();
+    test_config_missing_file();
+
+    printf(" 11 ");
+    test_env_fallback();
+    test_env_take_values();
+    test_env_precedence();
+    test_env_command();
+    test_env_moved();
+
+    printf(" 12 ");
+    test_config_reload();
+    test_config_watch_sighup();
+    test_config_watch_file();
+    test_config_watch_recreate();
+    test_config_watch_restores_sighup();
+
+    printf(" 13 ");
+    test_snapshot_buffer();
+    test_snapshot_file();
+    test_snapshot_aliases();
+    test_snapshot_invalid();
+
+    printf(" 14 ");
+    test_hash_spelling();
+    test_hash_order();
+    test_hash_command();
+    test_hash_reset();
+
+    printf(" 15 ");
+    test_cache_hits();
+    test_cache_errors();
+    test_cache_keys();
+    test_cache_eviction();
+
+    printf(" 16 ");
+    test_feed_options();
+    test_feed_dashdash();
+    test_feed_command();
+
+    printf(" 17 ");
+    test_collect_errors();
+    test_collect_errors_command();
+    test_collect_errors_help();
+
+    printf(" 18 ");
+    test_constraints();
+    test_constraints_callback();
+    test_constraints_many();
+    test_constraints_short_group();
+    test_constraints_config();
+
+    printf(" 19 ");
+    test_choice();
+    test_choice_invalid();
+    test_choice_many();
+    test_choice_env_config();
+
+    printf(" 20 ");
+    test_abbrev_options();
+    test_abbrev_equals();
+    test_abbrev_commands();
+    test_abbrev_disabled();
+
+    printf(" 21 ");
+    test_completion();
+
+    printf(" 22 ");
+    test_suggestions();
+    test_suggestions_many();
+
+    printf(" 23 ");
+    test_map_option();
+    test_map_option_invalid();
+    test_map_option_many();
+    test_map_option_env_config();
+    test_map_option_snapshot();
+
     printf(" [ok]\n");
     line();
 }